@@ -101,7 +101,7 @@ namespace sqlite3pp
   {
     int rc = SQLITE_OK;
     if (db_) {
-      rc = sqlite3_close(db_);
+      rc = sqlite3_close_v2(db_);
       db_ = 0;
     }
 
@@ -153,6 +153,21 @@ namespace sqlite3pp
     return sqlite3_last_insert_rowid(db_);
   }
 
+  int database::changes() const
+  {
+    return sqlite3_changes(db_);
+  }
+
+  int database::total_changes() const
+  {
+    return sqlite3_total_changes(db_);
+  }
+
+  bool database::readonly() const
+  {
+    return sqlite3_db_readonly(db_, "main") == 1;
+  }
+
   int database::error_code() const
   {
     return sqlite3_errcode(db_);
@@ -211,7 +226,12 @@ namespace sqlite3pp
 
   int statement::prepare_impl(char const* stmt)
   {
-    return sqlite3_prepare(db_.db_, stmt, strlen(stmt), &stmt_, &tail_);
+    return sqlite3_prepare_v2(db_.db_, stmt, strlen(stmt), &stmt_, &tail_);
+  }
+
+  bool statement::readonly() const
+  {
+    return sqlite3_stmt_readonly(stmt_) != 0;
   }
 
   int statement::finish()
@@ -241,6 +261,11 @@ namespace sqlite3pp
     return sqlite3_reset(stmt_);
   }
 
+  int statement::clear_bindings()
+  {
+    return sqlite3_clear_bindings(stmt_);
+  }
+
   int statement::bind(int idx, int value)
   {
     return sqlite3_bind_int(stmt_, idx, value);
@@ -322,6 +347,11 @@ namespace sqlite3pp
     return bind(name);
   }
 
+  int statement::bind_parameter_index(char const* name) const
+  {
+    return sqlite3_bind_parameter_index(stmt_, name);
+  }
+
 
   command::bindstream::bindstream(command& cmd, int idx) : cmd_(cmd), idx_(idx)
   {
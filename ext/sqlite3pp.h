@@ -71,6 +71,9 @@ namespace sqlite3pp
     int detach(char const* name);
 
     long long int last_insert_rowid() const;
+    int changes() const;
+    int total_changes() const;
+    bool readonly() const;
 
     int error_code() const;
     char const* error_msg() const;
@@ -108,6 +111,7 @@ namespace sqlite3pp
    public:
     int prepare(char const* stmt);
     int finish();
+    bool readonly() const;
 
     int bind(int idx, int value);
     int bind(int idx, double value);
@@ -126,8 +130,11 @@ namespace sqlite3pp
     int bind(char const* name);
     int bind(char const* name, null_type);
 
+    int bind_parameter_index(char const* name) const;
+
     int step();
     int reset();
+    int clear_bindings();
 
    protected:
     explicit statement(database& db, char const* stmt = 0);
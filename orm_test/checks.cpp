@@ -0,0 +1,1020 @@
+//
+//  checks.cpp
+//  orm_test
+//
+//  Behaviour checks, one function per feature. Build like main.cpp;
+//  the exit code is the number of failed checks.
+//
+
+#include <iostream>
+#include <cstdio>
+#include "sqlite_orm.h"
+
+class user;
+
+#undef  MODEL_NAME
+#define MODEL_NAME score
+BEGIN_MODEL_DECLARATION()
+: highscore(0)
+{
+}
+
+static const std::string table_name()
+{
+    return "scores";
+}
+
+FIELD_INT(highscore);
+BELONGS_TO(user, user);
+
+END_DECLARATION();
+
+#undef  MODEL_NAME
+#define MODEL_NAME user
+BEGIN_MODEL_DECLARATION()
+: name("Fernando")
+{
+}
+
+static const std::string table_name()
+{
+    return "users";
+}
+
+FIELD_STR(name);
+HAS_MANY(score, scores);
+
+END_DECLARATION();
+
+// never given a dao
+#undef  MODEL_NAME
+#define MODEL_NAME tag
+BEGIN_MODEL_DECLARATION()
+: label("")
+{
+}
+
+static const std::string table_name()
+{
+    return "tags";
+}
+
+FIELD_STR(label);
+
+END_DECLARATION();
+
+BELONGS_TO_IMPL(score, user, user);
+HAS_MANY_IMPL(user, score, scores);
+
+using namespace sqlite::orm;
+
+static const char* const db_file = "checks.db";
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+    std::cout << (ok ? "ok    " : "FAIL  ") << what << "\n";
+    if(!ok)
+    {
+        ++failures;
+    }
+}
+
+static void reset_tables(sqlite3pp::database& db)
+{
+    db.execute("DELETE FROM scores WHERE 1");
+    db.execute("DELETE FROM users WHERE 1");
+}
+
+static void add_users(int n, const std::string& name)
+{
+    for(int i = 0; i < n; ++i)
+    {
+        user u;
+        u.set_name(name);
+        dao<user>::save(u);
+    }
+}
+
+/*
+ *  user-001: prepared statement cache
+ */
+static void query_all_in_thread(bool* ok)
+{
+    for(int i = 0; i < 200; ++i)
+    {
+        *ok = dao<user>::query_all().size() == 10 && *ok;
+    }
+}
+
+static void check_statement_cache(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    add_users(10, "cached");
+    
+    const std::size_t hits = dao<user>::statements().hits();
+    dao<user>::query_all();
+    dao<user>::query_all();
+    check(dao<user>::statements().hits() > hits, "repeated queries reuse their statement");
+    
+    // threads sharing the dao's own connection
+    bool ok[4] = { true, true, true, true };
+    boost::thread_group threads;
+    for(int i = 0; i < 4; ++i)
+    {
+        threads.create_thread(boost::bind(&query_all_in_thread, &ok[i]));
+    }
+    threads.join_all();
+    check(ok[0] && ok[1] && ok[2] && ok[3], "threads can share the default connection");
+}
+
+/*
+ *  user-002: bulk save
+ */
+static void check_bulk_save(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    
+    std::vector<user> plain(50);
+    dao<user>::save_all(plain);
+    check(dao<user>::count() == 50 && plain.back().get_id() != -1, "save_all saves every object");
+    
+    // fewer objects than one chunk still go in a single INSERT
+    std::vector<user> many(300);
+    dao<user>::save_all(many, true);
+    check(db.changes() == 300, "multirow save_all inserts the remainder in one statement");
+    
+    bool ordered = true;
+    for(std::size_t i = 1; i < many.size(); ++i)
+    {
+        ordered = ordered && many[i].get_id() > many[i - 1].get_id();
+    }
+    check(ordered && dao<user>::count() == 350, "multirow ids are handed out in order");
+    
+    // inside the caller's transaction nothing is committed early
+    {
+        sqlite3pp::transaction xct(db);
+        std::vector<user> more(5);
+        dao<user>::save_all(more, true);
+    }
+    check(dao<user>::count() == 350, "save_all rolls back with the caller's transaction");
+}
+
+/*
+ *  user-003: typed fields
+ */
+static void check_typed_fields(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    add_users(1, "1");
+    add_users(1, "Alice");
+    
+    boost::shared_ptr<user> u = dao<user>::query_by__fieldname__("name", "Alice");
+    check(u && u->get_name() == "Alice", "query by a string literal binds it as text");
+    
+    u = dao<user>::query_by__fieldname__("name", std::string("Alice"));
+    check(u && u->get_name() == "Alice", "query by a std::string");
+    
+    score s;
+    s.set_highscore(42);
+    dao<score>::save(s);
+    check(dao<score>::query_by__fieldname__("highscore", 42)->get_highscore() == 42, "int fields round trip");
+}
+
+/*
+ *  user-004: positional binds
+ */
+static void check_positional_binds(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    
+    user u;
+    u.set_name("positional");
+    dao<user>::save(u);
+    check(dao<user>::query_by__fieldname__("id__", u.get_id())->get_name() == "positional", "insert binds every field");
+    
+    u.set_name("moved");
+    dao<user>::save(u);
+    check(dao<user>::query_by__fieldname__("id__", u.get_id())->get_name() == "moved", "update binds every field");
+    
+    for(int i = 0; i < 10; ++i)
+    {
+        score s;
+        s.set_highscore(i);
+        dao<score>::save(s);
+    }
+    
+    // the names sort the other way round than they appear in the SQL
+    std::map<std::string, boost::any> args;
+    args[":a"] = 8;
+    args[":b"] = 2;
+    check(dao<score>::query_all("WHERE highscore > :b AND highscore < :a", args).size() == 5, "arguments bind by name, not by order");
+}
+
+/*
+ *  user-005: cursors
+ */
+static void ignore_row(user&)
+{
+}
+
+static bool stop_at_first(user&)
+{
+    return false;
+}
+
+static cursor<user> cursor_by_temporary_name()
+{
+    // the name is gone before the cursor is stepped
+    return dao<user>::cursor_all_by__fieldname__("name", std::string("streamed"));
+}
+
+static cursor<user> cursor_by_temporary_args()
+{
+    std::map<std::string, boost::any> args;
+    args[":n"] = std::string("streamed");
+    return dao<user>::cursor_all("WHERE name = :n", args);
+}
+
+static void check_cursors(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    add_users(3, "streamed");
+    add_users(2, "other");
+    
+    cursor<user> by_name = cursor_by_temporary_name();
+    check(by_name.for_each(&ignore_row) == 3, "cursor keeps its own copy of a bound value");
+    
+    cursor<user> by_args = cursor_by_temporary_args();
+    check(by_args.for_each(&ignore_row) == 3, "cursor keeps its own copy of bound arguments");
+    
+    cursor<user> a = dao<user>::cursor_all();
+    cursor<user> b = a;
+    a.next();
+    b.next();
+    check(a.get() == b.get() && a.for_each(&ignore_row) == 3 && !b.next(), "cursor copies share their position");
+    
+    std::size_t seen = dao<user>::cursor_all().for_each_while(&stop_at_first);
+    check(seen == 1, "for_each_while stops early");
+}
+
+/*
+ *  user-006: result sets
+ */
+static void check_result_sets(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    add_users(100, "arena");
+    add_users(5, "other");
+    
+    // a small first block makes the arena grow a few times
+    result_set<user> rs(4);
+    check(dao<user>::query_all(rs) == 105 && rs.size() == 105, "query_all fills a result set");
+    check(rs[0].get_name() == "arena" && rs[104].get_name() == "other", "result set rows keep their values");
+    
+    rs.clear();
+    std::map<std::string, boost::any> args;
+    args[":n"] = std::string("other");
+    check(dao<user>::query_all("WHERE name = :n", args, rs) == 5 && rs.size() == 5, "a cleared result set is reused");
+    
+    dao<user>::query_all(rs);
+    check(rs.size() == 110, "query_all appends to a result set");
+}
+
+/*
+ *  user-007: row views
+ */
+struct count_named
+{
+    int column;
+    std::string name;
+    int* matches;
+    
+    void operator()(const row_view& row)
+    {
+        if(!row.is_null(column) && row.type(column) == SQLITE_TEXT && row.text(column) == name)
+        {
+            ++*matches;
+        }
+    }
+};
+
+static void check_row_views(sqlite3pp::database& db, dao<user>& users)
+{
+    reset_tables(db);
+    add_users(3, "visited");
+    add_users(2, "other");
+    
+    int matches = 0;
+    count_named f;
+    f.column = dao<user>::column_of("name");
+    f.name = "visited";
+    f.matches = &matches;
+    
+    check(users.visit(f) == 5 && matches == 3, "visit reads text in place");
+    check(dao<user>::column_of("id__") == 0 && dao<user>::column_of("nope") == -1, "column_of knows id__ and unknown fields");
+    
+    matches = 0;
+    std::map<std::string, boost::any> args;
+    args[":n"] = std::string("visited");
+    check(users.visit("WHERE name = :n", args, f) == 3 && matches == 3, "visit takes a condition");
+}
+
+/*
+ *  user-008: dirty tracking
+ */
+static void check_dirty_tracking(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    
+    score s;
+    s.set_highscore(10);
+    dao<score>::save(s);
+    check(!s.is_dirty(), "saved objects are clean");
+    
+    boost::shared_ptr<score> loaded = dao<score>::query_by__fieldname__("id__", s.get_id());
+    const int before = db.total_changes();
+    dao<score>::save(*loaded);
+    check(!loaded->is_dirty() && db.total_changes() == before, "saving an unchanged object writes nothing");
+    
+    // a column changed elsewhere survives a partial update of another one
+    db.execute(("UPDATE scores SET user_id = 99 WHERE id__ = " + boost::lexical_cast<std::string>(s.get_id())).c_str());
+    loaded->set_highscore(20);
+    check(loaded->is_dirty(), "setters mark the object dirty");
+    dao<score>::save(*loaded);
+    
+    sqlite3pp::query qry(db, ("SELECT user_id, highscore FROM scores WHERE id__ = " + boost::lexical_cast<std::string>(s.get_id())).c_str());
+    sqlite3pp::query::iterator row = qry.begin();
+    check((*row).get<int>(0) == 99 && (*row).get<int>(1) == 20, "updates write only the changed columns");
+}
+
+/*
+ *  user-009: eager loading
+ */
+static void check_eager_loading(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    
+    for(int i = 0; i < 3; ++i)
+    {
+        user u;
+        for(int j = 0; j < i; ++j)
+        {
+            score s;
+            u.add_to_scores(s);
+        }
+        dao<user>::save(u);
+    }
+    
+    std::vector<boost::shared_ptr<user> > users = dao<user>::query_all("ORDER BY id__", std::map<std::string, boost::any>());
+    
+    // the same parent twice must not get its children twice
+    users.push_back(users[2]);
+    user::prefetch_scores(users);
+    check(users[0]->get_scores().empty() && users[1]->get_scores().size() == 1 && users[2]->get_scores().size() == 2,
+        "prefetch hands every parent its own children");
+    
+    user::prefetch_scores(users);
+    check(users[2]->get_scores().size() == 2, "prefetching again replaces the collections");
+}
+
+/*
+ *  user-011: sessions
+ */
+static void check_sessions(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    add_users(2, "before");
+    
+    {
+        session s(db);
+        std::vector<boost::shared_ptr<user> > all = dao<user>::query_all();
+        boost::shared_ptr<user> one = dao<user>::query_by__fieldname__("id__", all[0]->get_id());
+        check(one.get() == all[0].get() && s.size() == 2, "a session returns one instance per row");
+        
+        one->set_name("after");
+        boost::shared_ptr<user> added(new user);
+        added->set_name("after");
+        s.attach(added);
+        s.flush();
+        check(added->get_id() != -1 && dao<user>::count("WHERE name = 'after'") == 2, "flush saves dirty and new objects");
+        
+        dao<user>::remove(*all[1]);
+        check(!s.find<user>(all[1]->get_id()), "removed objects leave the session");
+    }
+    check(!session::current(), "the session ends with its scope");
+}
+
+/*
+ *  user-012: object cache
+ */
+static void query_by_id_in_thread(long long id, bool* ok)
+{
+    for(int i = 0; i < 200; ++i)
+    {
+        boost::shared_ptr<user> u = dao<user>::query_by__fieldname__("id__", id);
+        *ok = u && u->get_name() == "cached" && *ok;
+    }
+}
+
+static void check_object_cache(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    dao<user>::enable_object_cache(16);
+    
+    user u;
+    u.set_name("cached");
+    dao<user>::save(u);
+    const long long id = u.get_id();
+    
+    {
+        session s(db);
+        boost::shared_ptr<user> mine = dao<user>::query_by__fieldname__("id__", id);
+        mine->set_name("unsaved");
+        check(dao<user>::query_by__fieldname__("id__", id).get() == mine.get(), "session hands out its own instance");
+    }
+    check(dao<user>::query_by__fieldname__("id__", id)->get_name() == "cached", "unsaved session edits stay out of the cache");
+    
+    bool ok[4] = { true, true, true, true };
+    boost::thread_group threads;
+    for(int i = 0; i < 4; ++i)
+    {
+        threads.create_thread(boost::bind(&query_by_id_in_thread, id, &ok[i]));
+    }
+    threads.join_all();
+    check(ok[0] && ok[1] && ok[2] && ok[3], "threads can share the object cache");
+    
+    {
+        sqlite3pp::database other(db_file);
+        other.execute(("UPDATE users SET name = 'external' WHERE id__ = " + boost::lexical_cast<std::string>(id)).c_str());
+    }
+    check(dao<user>::query_by__fieldname__("id__", id)->get_name() == "external", "commit of another connection drops the cache");
+    
+    {
+        unit_of_work work(db);
+        db.execute("UPDATE users SET name = 'undone'");
+        check(dao<user>::query_by__fieldname__("id__", id)->get_name() == "undone", "own uncommitted write is visible");
+    }
+    check(dao<user>::query_by__fieldname__("id__", id)->get_name() == "external", "rolled back unit of work drops the cache");
+    
+    db.execute("DELETE FROM users");
+    check(!dao<user>::query_by__fieldname__("id__", id), "DELETE without WHERE drops the cache");
+    
+    dao<user>::disable_object_cache();
+    
+    bool thrown = false;
+    try
+    {
+        dao<tag>::enable_object_cache(16);
+    }
+    catch(const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    check(thrown, "object cache without a dao throws");
+}
+
+/*
+ *  user-013: indexes
+ */
+static void check_indexes(sqlite3pp::database& db)
+{
+    sqlite3pp::query qry(db, "SELECT COUNT(*) FROM sqlite_master WHERE type = 'index' AND name = 'idx_scores_user_id'");
+    check((*qry.begin()).get<int>(0) == 1, "BELONGS_TO keys are indexed");
+    
+    const std::string plain = index_def("user_id, highscore").index_name("scores");
+    const std::string unique = index_def("user_id, highscore").unique().index_name("scores");
+    const std::string partial = index_def("user_id, highscore").where("highscore > 0").index_name("scores");
+    const std::string other = index_def("user_id, highscore").where("highscore > 1").index_name("scores");
+    check(plain == "idx_scores_user_id_highscore", "index names are made of table and columns");
+    check(plain != unique && plain != partial && partial != other, "index options are part of the name");
+    check(index_def("name").collate("NOCASE").index_name("users") == "idx_users_name_NOCASE", "collations are part of the name");
+    check(index_def("name").named("by_name").index_name("users") == "by_name", "named indexes keep their name");
+    
+    const std::string expr = index_def("lower(name) DESC").index_name("users");
+    check(expr.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_") == std::string::npos,
+        "index names are plain identifiers");
+}
+
+/*
+ *  user-014: keyset pagination
+ */
+static void check_pagination(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    
+    std::vector<score> all(20);
+    dao<score>::save_all(all);
+    db.execute("UPDATE scores SET highscore = NULL WHERE id__ % 3 = 0");
+    db.execute("UPDATE scores SET highscore = id__ % 4 WHERE id__ % 3 <> 0");
+    
+    for(int descending = 0; descending < 2; ++descending)
+    {
+        std::vector<long long> expected;
+        sqlite3pp::query qry(db, descending ? "SELECT id__ FROM scores ORDER BY highscore DESC, id__ DESC"
+                                            : "SELECT id__ FROM scores ORDER BY highscore, id__");
+        for(sqlite3pp::query::iterator i = qry.begin(); i != qry.end(); ++i)
+        {
+            expected.push_back((*i).get<long long>(0));
+        }
+        
+        std::vector<long long> paged;
+        std::size_t pages = 0;
+        std::string token;
+        do
+        {
+            page<score> p = dao<score>::query_page("highscore", 4, token, descending != 0);
+            for(std::size_t i = 0; i < p.items.size(); ++i)
+            {
+                paged.push_back(p.items[i]->get_id());
+            }
+            token = p.next;
+            ++pages;
+        } while(!token.empty());
+        
+        check(paged == expected, descending ? "descending pages cross NULL values" : "ascending pages cross NULL values");
+        check(pages <= 6, "a full last page may be followed by one empty page only");
+    }
+}
+
+/*
+ *  user-015: projections
+ */
+static void check_projections(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    
+    user u;
+    score s;
+    s.set_highscore(5);
+    u.add_to_scores(s);
+    dao<user>::save(u);
+    
+    std::vector<boost::shared_ptr<score> > partial = dao<score>::query_all_partial("highscore");
+    check(partial.size() == 1 && partial[0]->get_highscore() == 5 && partial[0]->get_id() != -1, "partial objects get id__ and the listed fields");
+    
+    partial[0]->set_highscore(6);
+    dao<score>::save(*partial[0]);
+    std::vector<boost::tuple<long long, int> > t = dao<score>::query_columns<boost::tuple<long long, int> >("user_id, highscore");
+    check(t.size() == 1 && t[0].get<0>() == u.get_id() && t[0].get<1>() == 6, "saving a partial object leaves the other columns");
+    
+    bool thrown = false;
+    try
+    {
+        dao<score>::query_all_partial("nope");
+    }
+    catch(const std::runtime_error&)
+    {
+        thrown = true;
+    }
+    check(thrown, "unknown projection fields throw");
+}
+
+/*
+ *  user-016: aggregates
+ */
+static void check_aggregates(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    check(dao<score>::count() == 0 && !dao<score>::exists(), "aggregates over no rows");
+    check(dao<score>::max<int>("highscore") == 0, "MAX over no rows reads as zero");
+    
+    user mine, theirs;
+    for(int i = 1; i <= 4; ++i)
+    {
+        score s;
+        s.set_highscore(i * 10);
+        (i % 2 ? mine : theirs).add_to_scores(s);
+    }
+    dao<user>::save(mine);
+    dao<user>::save(theirs);
+    
+    std::map<std::string, boost::any> args;
+    args[":h"] = 15;
+    check(dao<score>::count("WHERE highscore > :h", args) == 3, "count with a condition");
+    check(dao<score>::sum<int>("highscore") == 100 && dao<score>::min<int>("highscore") == 10, "sum and min");
+    check(dao<score>::avg("highscore") == 25.0 && dao<score>::exists("WHERE highscore = 40"), "avg and exists");
+    
+    check(mine.count_scores() == 2 && mine.max_scores<int>("highscore") == 30, "aggregates over one owner's children");
+    check(theirs.sum_scores<int>("highscore") == 60 && theirs.count_scores("highscore > :h", args) == 2, "owner aggregates take conditions");
+}
+
+/*
+ *  user-017: cascading remove
+ */
+static void check_cascading_remove(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    
+    user u;
+    score a, b;
+    u.add_to_scores(a);
+    u.add_to_scores(b);
+    dao<user>::save(u);
+    check(dao<user>::count() == 1 && dao<score>::count() == 2, "saving a user saves its scores");
+    
+    dao<user>::remove(u);
+    check(dao<user>::count() == 0 && dao<score>::count() == 0, "removing a user removes its scores");
+    
+    dao<user>::save(u);
+    check(dao<user>::count() == 1 && dao<score>::count() == 2, "saving a removed user writes its scores again");
+}
+
+/*
+ *  user-010: resolving owners
+ */
+static void check_resolve_owners(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    
+    user u;
+    score a, b;
+    u.add_to_scores(a);
+    u.add_to_scores(b);
+    dao<user>::save(u);
+    
+    boost::weak_ptr<user> owner;
+    {
+        // the session hands prefetch the already resolved children
+        session s(db);
+        std::vector<boost::shared_ptr<score> > scores = dao<score>::query_all();
+        score::resolve_user(scores);
+        check(scores.size() == 2 && scores[0]->get_user() && scores[0]->get_user() == scores[1]->get_user(), "resolve shares one owner");
+        
+        std::vector<boost::shared_ptr<user> > owners(1, scores[0]->get_user());
+        user::prefetch_scores(owners);
+        check(owners[0]->get_scores().size() == 2, "prefetch fills the owner's collection");
+        
+        owner = owners[0];
+    }
+    check(owner.expired(), "resolved owners are freed with their children");
+}
+
+/*
+ *  user-018: atomic object graphs
+ */
+static void check_atomic_graphs(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    db.execute("CREATE TRIGGER no_sevens BEFORE INSERT ON scores WHEN NEW.highscore = 7 "
+               "BEGIN SELECT RAISE(ABORT, 'no sevens'); END");
+    
+    user u;
+    score good, bad;
+    bad.set_highscore(7);
+    u.add_to_scores(good);
+    u.add_to_scores(bad);
+    
+    bool thrown = false;
+    try
+    {
+        dao<user>::save(u);
+    }
+    catch(database_error&)
+    {
+        thrown = true;
+    }
+    
+    check(thrown, "graph save fails on a failing child");
+    check(dao<user>::count() == 0 && dao<score>::count() == 0, "nothing of the graph is written");
+    check(u.get_id() == -1, "the parent is new again after the rollback");
+    
+    db.execute("DROP TRIGGER no_sevens");
+    dao<user>::save(u);
+    check(u.get_id() != -1 && u.count_scores() == 2, "retry inserts the parent and both children");
+    
+    user other;
+    {
+        unit_of_work work(db);
+        dao<user>::save(other);
+    }
+    check(other.get_id() == -1 && dao<user>::count() == 1, "an uncommitted unit of work rolls back");
+    
+    {
+        unit_of_work work(db);
+        dao<user>::save(other);
+        work.commit();
+    }
+    check(other.get_id() != -1 && dao<user>::count() == 2, "a committed unit of work keeps its writes");
+}
+
+/*
+ *  user-019: upserts
+ */
+static void check_upserts(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    
+    user u;
+    u.set_name("first");
+    dao<user>::save(u);
+    const long long id = u.get_id();
+    
+    db.execute("CREATE TRIGGER no_deletes BEFORE DELETE ON users BEGIN SELECT RAISE(ABORT, 'deleted'); END");
+    bool thrown = false;
+    try
+    {
+        u.set_name("second");
+        dao<user>::save(u);
+    }
+    catch(database_error&)
+    {
+        thrown = true;
+    }
+    db.execute("DROP TRIGGER no_deletes");
+    check(!thrown && u.get_id() == id, "saving an existing row never deletes it");
+    
+    // the row went away behind the object's back
+    db.execute(("DELETE FROM users WHERE id__ = " + boost::lexical_cast<std::string>(id)).c_str());
+    u.set_name("third");
+    dao<user>::save(u);
+    boost::shared_ptr<user> back = dao<user>::query_by__fieldname__("id__", id);
+    check(back && back->get_name() == "third" && dao<user>::count() == 1, "a missing row is inserted again under its id");
+}
+
+/*
+ *  user-020: typed conditions
+ */
+static void check_typed_conditions(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    
+    user u;
+    for(int i = 0; i < 5; ++i)
+    {
+        score s;
+        s.set_highscore(i);
+        u.add_to_scores(s);
+    }
+    dao<user>::save(u);
+    
+    const sqlite3_int64 id = u.get_id();
+    std::vector<boost::shared_ptr<score> > r = dao<score>::query_all(where(score::col_highscore() >= 3 && score::col_user_id() == id));
+    check(r.size() == 2, "AND of typed comparisons");
+    
+    r = dao<score>::query_all(where(score::col_highscore() < 1 || score::col_highscore() > 3));
+    check(r.size() == 2, "OR of typed comparisons");
+    
+    // same shape, other values: the cached statement is bound again
+    r = dao<score>::query_all(where(score::col_highscore() >= 1 && score::col_user_id() == id));
+    check(r.size() == 4, "one shape with different values");
+    
+    boost::shared_ptr<user> found = dao<user>::query_first(where(user::col_name() == std::string("Fernando")));
+    check(found && found->get_id() == id && !dao<user>::query_first(where(user::col_id() != id)), "typed text and id conditions");
+}
+
+/*
+ *  user-021: connection pool and scopes
+ */
+static void check_connection_scopes(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    add_users(3, "pooled");
+    
+    {
+        connection_pool pool(db_file, 2);
+        connection_scope scope(pool);
+        check(dao<user>::count() == 3, "a pooled scope reads through its reader");
+        
+        user u;
+        dao<user>::save(u);
+        check(dao<user>::count() == 4, "a pooled scope writes through the writer");
+    }
+    
+    // fresh connections to files that differ, possibly at one address
+    sqlite3pp::query qry(db, "SELECT sql FROM sqlite_master WHERE name = 'users'");
+    const std::string schema = (*qry.begin()).get<const char*>(0);
+    
+    bool fresh = true;
+    for(int i = 1; i <= 3; ++i)
+    {
+        const std::string file = "checks_scope.db";
+        std::remove(file.c_str());
+        
+        sqlite3pp::database* other = new sqlite3pp::database(file.c_str());
+        other->execute(schema.c_str());
+        {
+            connection_scope scope(*other);
+            add_users(i, "scoped");
+            fresh = dao<user>::count() == i && fresh;
+        }
+        delete other;
+        std::remove(file.c_str());
+    }
+    check(fresh, "a new connection never gets statements of an old one");
+    check(dao<user>::count() == 4, "scopes leave the dao's own connection alone");
+}
+
+/*
+ *  user-022: read/write routing
+ */
+static void check_write_routing(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    
+    connection_pool pool(db_file, 2, 0);
+    {
+        connection_scope scope(pool);
+        check(connection_scope::current()->readonly(), "a pooled scope reads through a read-only connection");
+        
+        user u;
+        dao<user>::save(u);
+        check(u.get_id() != -1 && dao<user>::count() == 1, "writes of a pooled scope go to the writer");
+    }
+    check(dao<user>::count() == 1, "pooled writes are committed");
+    
+    // another connection holds the write lock; no waiting with busy_timeout 0
+    sqlite3pp::database other(db_file);
+    other.execute("BEGIN IMMEDIATE");
+    
+    user blocked;
+    bool thrown = false;
+    {
+        connection_scope scope(pool);
+        try
+        {
+            dao<user>::save(blocked);
+        }
+        catch(database_error&)
+        {
+            thrown = true;
+        }
+    }
+    other.execute("ROLLBACK");
+    check(thrown && blocked.get_id() == -1, "a write that can't take the writer fails before writing");
+}
+
+/*
+ *  user-023: async operations
+ */
+static void check_async(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    worker_pool workers(db_file, 2);
+    
+    boost::shared_ptr<user> u(new user);
+    for(int i = 0; i < 5; ++i)
+    {
+        u->set_name("v" + boost::lexical_cast<std::string>(i));
+        dao<user>::save_async(workers, u).get();
+    }
+    check(dao<user>::count() == 1 && dao<user>::query_first()->get_name() == "v4", "save_async saves and updates");
+    
+    // queued on one object without touching it in between
+    boost::shared_future<void> saved = dao<user>::save_async(workers, u);
+    boost::shared_future<void> removed = dao<user>::remove_async(workers, u);
+    saved.get();
+    removed.get();
+    check(dao<user>::count() == 0, "calls on one object run in order");
+    
+    add_users(3, "async");
+    check(dao<user>::query_all_async(workers, "WHERE name = 'async'").get().size() == 3, "query_all_async");
+    
+    db.execute("CREATE TRIGGER no_bad BEFORE INSERT ON users WHEN NEW.name = 'bad' "
+               "BEGIN SELECT RAISE(ABORT, 'bad name'); END");
+    
+    boost::shared_ptr<user> bad(new user);
+    bad->set_name("bad");
+    bool thrown = false;
+    try
+    {
+        dao<user>::save_async(workers, bad).get();
+    }
+    catch(std::exception&)
+    {
+        thrown = true;
+    }
+    check(thrown && bad->get_id() == -1, "save_async failure reaches the future and leaves the object new");
+    
+    db.execute("DROP TRIGGER no_bad");
+    bad->set_name("good");
+    dao<user>::save_async(workers, bad).get();
+    check(bad->get_id() != -1, "save_async retry succeeds");
+}
+
+/*
+ *  user-024: posting from a worker
+ */
+struct repost
+{
+    worker_pool* workers;
+    boost::shared_ptr<user> obj;
+    boost::shared_future<void> last;
+    boost::promise<void> posted;
+    
+    void operator()(boost::shared_future<void>)
+    {
+        // the queue of this very worker holds one task at most
+        dao<user>::save_async(*workers, obj);
+        last = dao<user>::save_async(*workers, obj);
+        posted.set_value();
+    }
+};
+
+static void check_worker_reposts(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    
+    worker_pool workers(db_file, 1, 1);
+    repost r;
+    r.workers = &workers;
+    r.obj.reset(new user);
+    
+    dao<user>::save_async(workers, r.obj, boost::ref(r));
+    r.posted.get_future().get();
+    r.last.get();
+    check(dao<user>::count() == 1, "a worker posting to its own full queue doesn't wait on itself");
+}
+
+/*
+ *  user-025: write-behind
+ */
+static void check_save_behind(sqlite3pp::database& db)
+{
+    reset_tables(db);
+    write_behind writer(db_file, 100);
+    
+    std::vector<boost::shared_ptr<score> > queued;
+    boost::shared_future<void> last;
+    for(int i = 0; i < 50; ++i)
+    {
+        queued.push_back(boost::shared_ptr<score>(new score));
+        queued.back()->set_highscore(i);
+        last = dao<score>::save_behind(writer, queued.back());
+    }
+    last.get();
+    
+    bool ordered = true;
+    for(std::size_t i = 1; i < queued.size(); ++i)
+    {
+        ordered = ordered && queued[i]->get_id() > queued[i - 1]->get_id();
+    }
+    check(ordered, "save_behind writes in queue order");
+    
+    db.execute("CREATE TRIGGER no_sevens BEFORE INSERT ON scores WHEN NEW.highscore = 7 "
+               "BEGIN SELECT RAISE(ABORT, 'no sevens'); END");
+    
+    boost::shared_ptr<score> bad(new score), good(new score);
+    bad->set_highscore(7);
+    boost::shared_future<void> fb = dao<score>::save_behind(writer, bad);
+    boost::shared_future<void> fg = dao<score>::save_behind(writer, good);
+    
+    bool thrown = false;
+    try
+    {
+        fb.get();
+    }
+    catch(std::exception&)
+    {
+        thrown = true;
+    }
+    fg.get();
+    check(thrown && bad->get_id() == -1, "failed save_behind reaches its ticket and leaves the object new");
+    check(good->get_id() != -1, "a failed write doesn't spoil its batch");
+    
+    db.execute("DROP TRIGGER no_sevens");
+    dao<score>::save_behind(writer, bad).get();
+    check(bad->get_id() != -1, "save_behind retry succeeds");
+}
+
+int main(int argc, const char * argv[])
+{
+    std::remove(db_file);
+    std::remove((std::string(db_file) + "-wal").c_str());
+    std::remove((std::string(db_file) + "-shm").c_str());
+    
+    {
+        sqlite3pp::database db_(db_file);
+        dao<user> user_dao(db_);
+        dao<score> score_dao(db_);
+        
+        check_statement_cache(db_);
+        check_bulk_save(db_);
+        check_typed_fields(db_);
+        check_positional_binds(db_);
+        check_cursors(db_);
+        check_result_sets(db_);
+        check_row_views(db_, user_dao);
+        check_dirty_tracking(db_);
+        check_eager_loading(db_);
+        check_sessions(db_);
+        check_object_cache(db_);
+        check_resolve_owners(db_);
+        check_indexes(db_);
+        check_pagination(db_);
+        check_projections(db_);
+        check_aggregates(db_);
+        check_cascading_remove(db_);
+        check_atomic_graphs(db_);
+        check_upserts(db_);
+        check_typed_conditions(db_);
+        check_connection_scopes(db_);
+        check_write_routing(db_);
+        check_async(db_);
+        check_worker_reposts(db_);
+        check_save_behind(db_);
+    }
+    
+    std::cout << failures << " failed\n";
+    return failures;
+}
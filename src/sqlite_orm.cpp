@@ -7,6 +7,7 @@
 //
 
 #include "sqlite_orm.h"
+#include <cctype>
 
 namespace sqlite {
 namespace orm {
@@ -52,6 +53,806 @@ namespace orm {
     {
         return boost::lexical_cast<std::string>(v);
     }
+    
+    // Keeps [A-Za-z0-9_] so that expressions make valid identifiers
+    static std::string identifier_part(const std::string& s)
+    {
+        std::string out(s);
+        for(std::string::iterator it = out.begin(); it != out.end(); ++it)
+        {
+            if(!std::isalnum(static_cast<unsigned char>(*it)))
+            {
+                *it = '_';
+            }
+        }
+        return out;
+    }
+    
+    // FNV-1a; index names end up in the database file and must not change
+    static std::string stable_hash(const std::string& s)
+    {
+        unsigned long h = 2166136261UL;
+        for(std::string::const_iterator it = s.begin(); it != s.end(); ++it)
+        {
+            h = ((h ^ static_cast<unsigned char>(*it)) * 16777619UL) & 0xffffffffUL;
+        }
+        
+        std::ostringstream ss;
+        ss << std::hex << h;
+        return ss.str();
+    }
+    
+    const std::string index_def::index_name(const std::string& table) const
+    {
+        if(!name.empty())
+        {
+            return name;
+        }
+        
+        std::string idx = "idx_" + table;
+        
+        std::stringstream ss(columns);
+        std::string col;
+        while(std::getline(ss, col, ','))
+        {
+            col.erase(0, col.find_first_not_of(" "));
+            col.erase(col.find_last_not_of(" ") + 1);
+            idx.append("_").append(identifier_part(col));
+        }
+        
+        // options are part of the name so that variants don't collide
+        if(is_unique)
+        {
+            idx.append("_unique");
+        }
+        if(!collation.empty())
+        {
+            idx.append("_").append(identifier_part(collation));
+        }
+        if(!condition.empty())
+        {
+            idx.append("_where_").append(stable_hash(condition));
+        }
+        
+        return idx;
+    }
+    
+    const std::string index_def::sql(const std::string& table) const
+    {
+        std::string cols;
+        
+        std::stringstream ss(columns);
+        std::string col;
+        while(std::getline(ss, col, ','))
+        {
+            col.erase(0, col.find_first_not_of(" "));
+            col.erase(col.find_last_not_of(" ") + 1);
+            
+            cols.append(cols.empty() ? "" : ", ").append(col);
+            if(!collation.empty())
+            {
+                cols.append(" COLLATE ").append(collation);
+            }
+        }
+        
+        std::string q = is_unique ? "CREATE UNIQUE INDEX IF NOT EXISTS " : "CREATE INDEX IF NOT EXISTS ";
+        q.append(index_name(table)).append(" ON ").append(table).append(" (").append(cols).append(")");
+        if(!condition.empty())
+        {
+            q.append(" WHERE ").append(condition);
+        }
+        
+        return q;
+    }
+    
+    boost::thread_specific_ptr<unit_of_work> unit_of_work::current_(&unit_of_work::keep);
+    
+    unit_of_work::unit_of_work(database& db, bool enabled, bool immediate)
+    : db_(enabled ? &db : NULL)
+    , outer_(current_.get())
+    , immediate_(immediate)
+    , committed_(false)
+    {
+        if(!db_)
+        {
+            return;
+        }
+        
+        if(db.execute(immediate_ ? "BEGIN IMMEDIATE" : "SAVEPOINT orm_work") != SQLITE_OK)
+        {
+            throw database_error(db);
+        }
+        current_.reset(this);
+    }
+    
+    unit_of_work::~unit_of_work()
+    {
+        if(!db_)
+        {
+            return;
+        }
+        
+        current_.reset(outer_);
+        if(committed_)
+        {
+            return;
+        }
+        
+        // fails harmlessly if sqlite already rolled the transaction back
+        if(immediate_)
+        {
+            db_->execute("ROLLBACK");
+        }
+        else if(db_->execute("ROLLBACK TO orm_work") == SQLITE_OK)
+        {
+            db_->execute("RELEASE orm_work");
+        }
+        
+        // the rollback hook only sees whole transactions
+        change_hooks::invalidate(*db_);
+        
+        // oldest state last, in case an object was written more than once
+        for(std::vector<snapshot>::reverse_iterator it = journal_.rbegin(); it != journal_.rend(); ++it)
+        {
+            *it->id = it->old_id;
+            *it->dirty = it->old_dirty;
+        }
+    }
+    
+    void unit_of_work::commit()
+    {
+        if(!db_ || committed_)
+        {
+            return;
+        }
+        
+        // left open on failure, so the destructor rolls back and restores
+        if(db_->execute(immediate_ ? "COMMIT" : "RELEASE orm_work") != SQLITE_OK)
+        {
+            throw database_error(*db_);
+        }
+        committed_ = true;
+        
+        // still undone if an enclosing unit rolls back
+        unit_of_work* outer = open_on(*db_, outer_);
+        if(outer)
+        {
+            outer->journal_.insert(outer->journal_.end(), journal_.begin(), journal_.end());
+        }
+        journal_.clear();
+    }
+    
+    unit_of_work* unit_of_work::open_on(database& db, unit_of_work* from)
+    {
+        for(unit_of_work* w = from; w; w = w->outer_)
+        {
+            if(w->db_ == &db && !w->committed_)
+            {
+                return w;
+            }
+        }
+        return NULL;
+    }
+    
+    change_hooks::map_type& change_hooks::listeners()
+    {
+        // never destroyed: listeners may unsubscribe during static destruction
+        static map_type* m = new map_type;
+        return *m;
+    }
+    
+    boost::mutex& change_hooks::mutex()
+    {
+        static boost::mutex* m = new boost::mutex;
+        return *m;
+    }
+    
+    connection_pool::connection_pool(const std::string& file, std::size_t size, int busy_timeout)
+    : writer_(open(file, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, busy_timeout))
+    {
+        // WAL is a property of the file, set once by the writer
+        writer_->execute("PRAGMA journal_mode=WAL");
+        
+        for(std::size_t i = 0; i < size; ++i)
+        {
+            all_.push_back(open(file, SQLITE_OPEN_READONLY, busy_timeout));
+        }
+        
+        free_ = all_;
+    }
+    
+    connection_pool::~connection_pool()
+    {
+        for(std::vector<database*>::iterator it = all_.begin(); it != all_.end(); ++it)
+        {
+            connection_caches::drop(**it);
+            delete *it;
+        }
+        
+        connection_caches::drop(*writer_);
+        delete writer_;
+    }
+    
+    database* connection_pool::open(const std::string& file, int flags, int busy_timeout)
+    {
+        database* db = new database();
+        if(db->connect_v2(file.c_str(), flags | SQLITE_OPEN_NOMUTEX) != SQLITE_OK)
+        {
+            database_error err(*db);
+            delete db;
+            throw err;
+        }
+        
+        db->set_busy_timeout(busy_timeout);
+        return db;
+    }
+    
+    database& connection_pool::acquire()
+    {
+        boost::mutex::scoped_lock lock(mtx_);
+        while(free_.empty())
+        {
+            cond_.wait(lock);
+        }
+        
+        database* db = free_.back();
+        free_.pop_back();
+        return *db;
+    }
+    
+    void connection_pool::release(database& db)
+    {
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            free_.push_back(&db);
+        }
+        cond_.notify_one();
+    }
+    
+    boost::thread_specific_ptr<database> connection_scope::current_(&connection_scope::keep);
+    boost::thread_specific_ptr<connection_pool> connection_scope::pool_tss_(&connection_scope::keep_pool);
+    
+    connection_scope::connection_scope(connection_pool& pool)
+    : pool_(&pool)
+    , db_(pool.acquire())
+    , previous_(current_.get())
+    , previous_pool_(pool_tss_.get())
+    , pooled_(true)
+    {
+        current_.reset(&db_);
+        pool_tss_.reset(pool_);
+    }
+    
+    connection_scope::connection_scope(database& db)
+    : pool_(NULL)
+    , db_(db)
+    , previous_(current_.get())
+    , previous_pool_(pool_tss_.get())
+    , pooled_(false)
+    {
+        connection_caches::bind(db_);
+        current_.reset(&db_);
+    }
+    
+    connection_scope::connection_scope(connection_pool&, database& db)
+    : pool_(NULL)
+    , db_(db)
+    , previous_(current_.get())
+    , previous_pool_(pool_tss_.get())
+    , pooled_(true)
+    {
+        current_.reset(&db_);
+    }
+    
+    connection_scope::~connection_scope()
+    {
+        current_.reset(previous_);
+        pool_tss_.reset(previous_pool_);
+        if(pool_)
+        {
+            pool_->release(db_);
+        }
+        
+        if(!pooled_)
+        {
+            connection_caches::unbind(db_);
+        }
+    }
+    
+    database* connection_scope::current()
+    {
+        return current_.get();
+    }
+    
+    connection_pool* connection_scope::pool()
+    {
+        return pool_tss_.get();
+    }
+    
+    static database& writer_of(connection_pool* pool, database& fallback)
+    {
+        if(pool)
+        {
+            return pool->writer();
+        }
+        
+        database* bound = connection_scope::current();
+        return bound ? *bound : fallback;
+    }
+    
+    write_scope::write_scope(database& fallback)
+    : db_(writer_of(connection_scope::pool(), fallback))
+    {
+        connection_pool* pool = connection_scope::pool();
+        if(pool && connection_scope::current() != &db_)
+        {
+            lock_.reset(new boost::mutex::scoped_lock(pool->writer_mutex()));
+            bind_.reset(new connection_scope(*pool, db_));
+            
+            // throws before any write if the writer can't be reserved
+            work_.reset(new unit_of_work(db_, true, true));
+        }
+    }
+    
+    write_scope::~write_scope()
+    {
+        // rolls back unless committed, then unbinds and unlocks the writer
+        work_.reset();
+        bind_.reset();
+        lock_.reset();
+    }
+    
+    void write_scope::commit()
+    {
+        if(work_)
+        {
+            work_->commit();
+        }
+    }
+    
+    boost::thread_specific_ptr<worker_pool> worker_pool::current_(&worker_pool::keep);
+    
+    worker_pool::worker_pool(const std::string& file, std::size_t threads, std::size_t queue_limit)
+    : pool_(file, threads)
+    , limit_(std::max<std::size_t>(1, queue_limit / std::max<std::size_t>(1, threads)))
+    , next_(0)
+    {
+        for(std::size_t i = 0; i < threads; ++i)
+        {
+            queues_.push_back(new queue());
+            threads_.create_thread(boost::bind(&worker_pool::run, this, queues_.back()));
+        }
+    }
+    
+    worker_pool::~worker_pool()
+    {
+        for(std::vector<queue*>::iterator it = queues_.begin(); it != queues_.end(); ++it)
+        {
+            {
+                boost::mutex::scoped_lock lock((*it)->mtx);
+                (*it)->stop = true;
+            }
+            (*it)->not_empty.notify_all();
+        }
+        
+        threads_.join_all();
+        
+        for(std::vector<queue*>::iterator it = queues_.begin(); it != queues_.end(); ++it)
+        {
+            delete *it;
+        }
+    }
+    
+    void worker_pool::post(const void* key, const task& t)
+    {
+        std::size_t slot;
+        if(key)
+        {
+            // low bits of an address are alignment
+            slot = (reinterpret_cast<std::size_t>(key) >> 4) % queues_.size();
+        }
+        else
+        {
+            boost::mutex::scoped_lock lock(next_mtx_);
+            slot = next_++ % queues_.size();
+        }
+        
+        queue& q = *queues_[slot];
+        {
+            boost::mutex::scoped_lock lock(q.mtx);
+            while(q.tasks.size() >= limit_ && current_.get() != this)
+            {
+                q.not_full.wait(lock);
+            }
+            q.tasks.push_back(t);
+        }
+        q.not_empty.notify_one();
+    }
+    
+    void worker_pool::run(queue* q)
+    {
+        connection_scope scope(pool_);
+        current_.reset(this);
+        
+        for(;;)
+        {
+            task t;
+            {
+                boost::mutex::scoped_lock lock(q->mtx);
+                while(q->tasks.empty() && !q->stop)
+                {
+                    q->not_empty.wait(lock);
+                }
+                
+                if(q->tasks.empty())
+                {
+                    return;
+                }
+                
+                t = q->tasks.front();
+                q->tasks.pop_front();
+            }
+            q->not_full.notify_one();
+            
+            try
+            {
+                t();
+            }
+            catch(...)
+            {
+                // a plain posted task has nobody to report to
+            }
+        }
+    }
+    
+    write_behind::write_behind(const std::string& file, std::size_t max_batch, int idle_wait_ms, int busy_timeout)
+    : max_batch_(std::max<std::size_t>(1, max_batch))
+    , idle_wait_ms_(idle_wait_ms)
+    , queue_(max_batch_)
+    , stop_(false)
+    , batches_(0)
+    {
+        if(db_.connect(file.c_str()) != SQLITE_OK)
+        {
+            throw database_error(db_);
+        }
+        
+        db_.set_busy_timeout(busy_timeout);
+        db_.execute("PRAGMA journal_mode=WAL");
+        
+        thread_ = boost::thread(boost::bind(&write_behind::run, this));
+    }
+    
+    write_behind::~write_behind()
+    {
+        stop_.store(true);
+        wake_.notify_one();
+        thread_.join();
+        
+        connection_caches::drop(db_);
+    }
+    
+    boost::shared_future<void> write_behind::enqueue(const task& write)
+    {
+        job* j = new job();
+        j->write = write;
+        boost::shared_future<void> ticket(j->done.get_future());
+        
+        queue_.push(j);
+        
+        // a missed wakeup only costs idle_wait_ms
+        wake_.notify_one();
+        return ticket;
+    }
+    
+    void write_behind::run()
+    {
+        connection_scope scope(db_);
+        
+        std::vector<job*> batch;
+        batch.reserve(max_batch_);
+        
+        for(;;)
+        {
+            job* j;
+            while(batch.size() < max_batch_ && queue_.pop(j))
+            {
+                batch.push_back(j);
+            }
+            
+            if(!batch.empty())
+            {
+                commit(batch);
+                batch.clear();
+                continue;
+            }
+            
+            // nothing queued; stop only once drained
+            if(stop_.load())
+            {
+                return;
+            }
+            
+            boost::mutex::scoped_lock lock(mtx_);
+            wake_.timed_wait(lock, boost::posix_time::milliseconds(idle_wait_ms_));
+        }
+    }
+    
+    void write_behind::commit(std::vector<job*>& batch)
+    {
+        std::vector<bool> failed(batch.size(), false);
+        bool committed = false;
+        
+        try
+        {
+            // nothing runs if the write lock can't be had
+            unit_of_work xct(db_, true, true);
+            
+            for(std::size_t i = 0; i < batch.size(); ++i)
+            {
+                try
+                {
+                    unit_of_work work(db_);
+                    batch[i]->write();
+                    work.commit();
+                }
+                catch(...)
+                {
+                    batch[i]->done.set_exception(current_error());
+                    failed[i] = true;
+                }
+            }
+            
+            xct.commit();
+            committed = true;
+        }
+        catch(database_error& e)
+        {
+            // the objects of the batch have their state back by now
+            for(std::size_t i = 0; i < batch.size(); ++i)
+            {
+                if(!failed[i])
+                {
+                    batch[i]->done.set_exception(boost::copy_exception(e));
+                    failed[i] = true;
+                }
+            }
+        }
+        
+        if(committed)
+        {
+            ++batches_;
+        }
+        
+        for(std::size_t i = 0; i < batch.size(); ++i)
+        {
+            if(!failed[i])
+            {
+                batch[i]->done.set_value();
+            }
+            delete batch[i];
+        }
+    }
+    
+    boost::mutex connection_caches::mtx_;
+    connection_caches::map_type connection_caches::caches_;
+    std::map<database*, int> connection_caches::scopes_;
+    
+    statement_cache& connection_caches::get(database& db, const void* owner)
+    {
+        boost::mutex::scoped_lock lock(mtx_);
+        statement_cache*& c = caches_[std::make_pair(&db, owner)];
+        if(!c)
+        {
+            c = new statement_cache();
+        }
+        return *c;
+    }
+    
+    void connection_caches::drop(database& db)
+    {
+        boost::mutex::scoped_lock lock(mtx_);
+        drop_locked(db);
+    }
+    
+    void connection_caches::bind(database& db)
+    {
+        boost::mutex::scoped_lock lock(mtx_);
+        ++scopes_[&db];
+    }
+    
+    void connection_caches::unbind(database& db)
+    {
+        boost::mutex::scoped_lock lock(mtx_);
+        std::map<database*, int>::iterator it = scopes_.find(&db);
+        if(it != scopes_.end() && --it->second == 0)
+        {
+            scopes_.erase(it);
+            drop_locked(db);
+        }
+    }
+    
+    void connection_caches::drop_locked(database& db)
+    {
+        for(map_type::iterator it = caches_.begin(); it != caches_.end();)
+        {
+            if(it->first.first == &db)
+            {
+                delete it->second;
+                caches_.erase(it++);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+    
+    // sqlite runs the hooks holding its connection mutex, so the
+    // connection is never called into while mutex() is held
+    void change_hooks::subscribe(database& db, change_listener* l)
+    {
+        const int changes = db.total_changes();
+        bool first = false;
+        {
+            boost::mutex::scoped_lock lock(mutex());
+            hooked& h = listeners()[&db];
+            if(h.listeners.empty())
+            {
+                h.changes = changes;
+                first = true;
+            }
+            
+            if(std::find(h.listeners.begin(), h.listeners.end(), l) == h.listeners.end())
+            {
+                h.listeners.push_back(l);
+            }
+        }
+        
+        if(first)
+        {
+            db.set_update_handler(boost::bind(&change_hooks::on_update, &db, _1, _2, _3, _4));
+            db.set_rollback_handler(boost::bind(&change_hooks::on_rollback, &db));
+        }
+    }
+    
+    void change_hooks::unsubscribe(database& db, change_listener* l)
+    {
+        {
+            boost::mutex::scoped_lock lock(mutex());
+            map_type::iterator it = listeners().find(&db);
+            if(it == listeners().end())
+            {
+                return;
+            }
+            
+            std::vector<change_listener*>& v = it->second.listeners;
+            v.erase(std::remove(v.begin(), v.end(), l), v.end());
+            if(!v.empty())
+            {
+                return;
+            }
+            listeners().erase(it);
+        }
+        
+        db.set_update_handler(database::update_handler());
+        db.set_rollback_handler(database::rollback_handler());
+    }
+    
+    void change_hooks::sync(database& db)
+    {
+        const int changes = db.total_changes();
+        {
+            boost::mutex::scoped_lock lock(mutex());
+            map_type::iterator it = listeners().find(&db);
+            if(it == listeners().end() || it->second.changes == changes)
+            {
+                return;
+            }
+        }
+        invalidate(db);
+    }
+    
+    void change_hooks::invalidate(database& db)
+    {
+        const int changes = db.total_changes();
+        {
+            boost::mutex::scoped_lock lock(mutex());
+            map_type::iterator it = listeners().find(&db);
+            if(it == listeners().end())
+            {
+                return;
+            }
+            it->second.changes = changes;
+        }
+        on_rollback(&db);
+    }
+    
+    void change_hooks::on_update(database* db, int, char const*, char const* table, long long rowid)
+    {
+        boost::mutex::scoped_lock lock(mutex());
+        map_type::iterator h = listeners().find(db);
+        if(h == listeners().end())
+        {
+            return;
+        }
+        
+        ++h->second.changes;
+        for(std::vector<change_listener*>::iterator it = h->second.listeners.begin(); it != h->second.listeners.end(); ++it)
+        {
+            (*it)->on_update(table, rowid);
+        }
+    }
+    
+    void change_hooks::on_rollback(database* db)
+    {
+        boost::mutex::scoped_lock lock(mutex());
+        map_type::iterator h = listeners().find(db);
+        if(h == listeners().end())
+        {
+            return;
+        }
+        
+        std::vector<change_listener*>& v = h->second.listeners;
+        for(std::vector<change_listener*>::iterator it = v.begin(); it != v.end(); ++it)
+        {
+            (*it)->on_rollback();
+        }
+    }
+    
+    boost::thread_specific_ptr<session> session::current_(&session::keep);
+    
+    session::session(database& db)
+    : db_(db)
+    , previous_(current_.get())
+    {
+        current_.reset(this);
+    }
+    
+    session::~session()
+    {
+        current_.reset(previous_);
+    }
+    
+    session* session::current()
+    {
+        return current_.get();
+    }
+    
+    void session::flush()
+    {
+        write_scope ws(db_);
+        unit_of_work work(ws.db());
+        
+        for(map_type::iterator it = objects_.begin(); it != objects_.end(); ++it)
+        {
+            if(it->second.dirty(it->second.obj.get()))
+            {
+                it->second.save(it->second.obj.get());
+            }
+        }
+        
+        // new objects get their ids now and become part of the identity map
+        for(std::vector<entry>::iterator it = new_.begin(); it != new_.end(); ++it)
+        {
+            it->save(it->obj.get());
+        }
+        
+        work.commit();
+        ws.commit();
+        
+        for(std::vector<entry>::iterator it = new_.begin(); it != new_.end(); ++it)
+        {
+            objects_[key(it->table, it->id(it->obj.get()))] = *it;
+        }
+        new_.clear();
+    }
+    
+    void session::clear()
+    {
+        objects_.clear();
+        new_.clear();
+    }
         
 }; // orm
 }; // sqlite
@@ -19,12 +19,36 @@
 #include <sstream>
 #include <algorithm>
 #include <map>
+#include <new>
+#include <bitset>
+#include <list>
+#include <deque>
+#include <cstring>
 
 #include <boost/any.hpp>
 #include <boost/bind.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/function.hpp>
+#include <boost/lockfree/queue.hpp>
+#include <boost/atomic.hpp>
 
 #include "sqlite3pp.h"
 
+// Default compile-time limit of host parameters in sqlite
+#ifndef SQLITE_MAX_VARIABLE_NUMBER
+#define SQLITE_MAX_VARIABLE_NUMBER 999
+#endif
+
+// Maximum number of fields per model (size of the dirty field mask)
+#ifndef SQLITE_ORM_MAX_FIELDS
+#define SQLITE_ORM_MAX_FIELDS 64
+#endif
+
 namespace sqlite {
 namespace orm {
     
@@ -37,595 +61,3121 @@ namespace orm {
     {
     };
     
-    struct sql_date
+    /*
+     *  UNIT OF WORK
+     *  Makes a group of writes atomic in a savepoint, nested inside the
+     *  caller's transaction if there is one ('immediate' instead begins
+     *  a BEGIN IMMEDIATE transaction on an idle connection). Rolled back
+     *  on destruction unless committed, and then the id__ and dirty
+     *  fields of every object written through it are put back as they
+     *  were. Such objects must outlive the unit.
+     */
+    class unit_of_work
+    : boost::noncopyable
     {
-        sqlite3_int64 value;
-        std::string svalue;
-        
-        sql_date(sqlite3_int64 v)
-        : value(v)
-        {}
+    public:
+        // Throws database_error if the savepoint or transaction can't be opened
+        explicit unit_of_work(database& db, bool enabled = true, bool immediate = false);
+        ~unit_of_work();
         
-        sql_date(const std::string& v)
-        : svalue(v)
-        {}
+        // Throws database_error if it can't be released or committed
+        void commit();
         
-        operator sqlite3_int64() { return value; }
-
-        const std::string to_string() const
+        // Remembers the state of 'obj' before the innermost open unit of
+        // this thread on 'db' writes it
+        template<typename M>
+        static void track(database& db, M& obj)
         {
-            if(svalue.empty())
+            unit_of_work* work = open_on(db, current_.get());
+            if(work)
             {
-                return boost::lexical_cast<std::string>(value);
+                work->journal_.push_back(snapshot(&obj.id__, &obj.dirty_));
             }
-            return svalue;
         }
-    };
-    
-    struct base_model;
-    
-    struct base_field
-    {
-        boost::any def;
         
-        template<typename T>
-        base_field(const T& a)
-        : def(a)
+    private:
+        typedef std::bitset<SQLITE_ORM_MAX_FIELDS> dirty_type;
+        
+        struct snapshot
+        {
+            sqlite3_int64* id;
+            dirty_type* dirty;
+            sqlite3_int64 old_id;
+            dirty_type old_dirty;
+            
+            snapshot(sqlite3_int64* i, dirty_type* d)
+            : id(i)
+            , dirty(d)
+            , old_id(*i)
+            , old_dirty(*d)
+            {}
+        };
+        
+        static unit_of_work* open_on(database& db, unit_of_work* from);
+        
+        static void keep(unit_of_work*)
         {
         }
         
-        virtual const std::string get_name() = 0;
-        virtual const std::string get_type() = 0;
-    };
-    
-    struct base_foreign_collection
-    {
-        int offset;
-        virtual void save(base_model&) = 0;
-        virtual void remove(base_model&) = 0;
+        static boost::thread_specific_ptr<unit_of_work> current_;
+        
+        database* db_;
+        unit_of_work* outer_;
+        bool immediate_;
+        bool committed_;
+        std::vector<snapshot> journal_;
     };
     
-    template<typename T>
-    struct foreign_collection
-    : public base_foreign_collection
+    /*
+     *  STATEMENT CACHE
+     *  Compiled statements are kept per (operation, field) key and
+     *  reused via reset/clear_bindings instead of being prepared again.
+     *  Threads sharing a connection share its cache; a statement is
+     *  handed to one of them at a time.
+     */
+    class statement_cache
+    : boost::noncopyable
     {
-        std::vector<T> collection;
-        void save(base_model&) = 0;
-        void remove(base_model&) = 0;
+    public:
+        typedef std::vector<std::pair<std::string, int> > params_type;
+        
+        struct entry
+        {
+            boost::shared_ptr<statement> stmt;
+            params_type params;
+            bool busy;
+            
+            entry()
+            : busy(false)
+            {}
+        };
+        
+        statement_cache()
+        : hits_(0)
+        , misses_(0)
+        {}
+        
+        // Returns NULL if the statement for this key is in use already
+        // (reentrant call). The caller then works on a private statement.
+        entry* acquire(const std::string& key)
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            entry& e = entries_[key];
+            if(e.busy || !e.stmt)
+            {
+                ++misses_;
+            }
+            else
+            {
+                ++hits_;
+            }
+            
+            if(e.busy)
+            {
+                return NULL;
+            }
+            
+            e.busy = true;
+            return &e;
+        }
+        
+        void release(entry& e)
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            e.busy = false;
+        }
+        
+        // Finalizes all statements which are not in use right now
+        void clear()
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            for(std::map<std::string, entry>::iterator it = entries_.begin(); it != entries_.end(); )
+            {
+                if(it->second.busy)
+                {
+                    ++it;
+                }
+                else
+                {
+                    entries_.erase(it++);
+                }
+            }
+        }
+        
+        std::size_t hits() const { return hits_; }
+        std::size_t misses() const { return misses_; }
+        std::size_t size() const { return entries_.size(); }
+        
+    private:
+        boost::mutex mtx_;
+        std::map<std::string, entry> entries_;
+        std::size_t hits_;
+        std::size_t misses_;
     };
     
-    template<typename T>
-    class dao
-    : public base_dao
-    , public T
+    /*
+     *  CACHED STATEMENT
+     *  Scoped handle to a statement from the cache. The statement is
+     *  reset and its bindings are cleared when the handle goes away.
+     */
+    template<typename S>
+    class cached_statement
+    : boost::noncopyable
     {
-    private:
-        void init(database& db)
+    public:
+        cached_statement(statement_cache& cache, const std::string& key)
+        : cache_(cache)
+        , entry_(cache.acquire(key))
         {
-            static bool _init = false;
-            if(!_init)
+            if(entry_)
             {
-                // Database is set only once
-                db_ = &db;
-                
-                // Create this table in DB
-                std::string q = "CREATE TABLE IF NOT EXISTS ";
-                q.append(T::table_name()).append(" (id__ INTEGER PRIMARY KEY AUTOINCREMENT, ");
-                for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                    it != T::fields_.end(); ++it)
-                {
-                    q.append((*it)->get_name());
-                    q.append(" ").append((*it)->get_type());
-                    if(it+1 != T::fields_.end())
-                    {
-                        q.append(", ");
-                    }
-                }
-                q.append(")");
-                
-#ifdef DEBUG_SQL
-                std::cout << q << "\n";
-#endif
-                db_->execute(q.c_str());
-                
-                _init = true;
+                stmt_ = entry_->stmt;
             }
         }
         
-        static boost::any get_field(query::rows::getstream& getter, std::vector<sqlite::orm::base_field*>::iterator& it)
+        ~cached_statement()
         {
-            if((*it)->def.type() == typeid(long))
+            if(stmt_)
             {
-                sqlite3_int64 val;
-                getter >> val;
-                return boost::any(val);
+                stmt_->reset();
+                stmt_->clear_bindings();
             }
-            else if((*it)->def.type() == typeid(int))
+            
+            if(entry_)
             {
-                int val;
-                getter >> val;
-                return boost::any(val);
+                cache_.release(*entry_);
             }
-            else if((*it)->def.type() == typeid(sqlite3_int64))
+        }
+        
+        bool prepared() const
+        {
+            return stmt_.get() != NULL;
+        }
+        
+        void prepare(database& db, const std::string& sql)
+        {
+#ifdef DEBUG_SQL
+            std::cout << sql << "\n";
+#endif
+            stmt_.reset(new S(db, sql.c_str()));
+            
+            // writes must have been routed to a writable connection
+            if(!stmt_->readonly() && db.readonly())
             {
-                sqlite3_int64 val;
-                getter >> val;
-                return boost::any(val);
+                stmt_.reset();
+                throw database_error(("Write on a read-only connection: " + sql).c_str());
             }
-            else if((*it)->def.type() == typeid(double))
+            
+            if(entry_)
             {
-                double val;
-                getter >> val;
-                return boost::any(val);
+                entry_->stmt = stmt_;
+                entry_->params.clear();
             }
-            else if((*it)->def.type() == typeid(std::string))
+        }
+        
+        // Resolved positions of named parameters, kept with the statement
+        statement_cache::params_type& params()
+        {
+            return entry_ ? entry_->params : params_;
+        }
+        
+        S& operator*() const
+        {
+            return *static_cast<S*>(stmt_.get());
+        }
+        
+        S* operator->() const
+        {
+            return static_cast<S*>(stmt_.get());
+        }
+        
+    private:
+        statement_cache& cache_;
+        statement_cache::entry* entry_;
+        boost::shared_ptr<statement> stmt_;
+        statement_cache::params_type params_;
+    };
+    
+    /*
+     *  CONNECTION POOL
+     *  Read-only connections to one database file plus a single writer.
+     *  The file is switched to WAL so readers don't block each other or
+     *  the writer. All are opened with SQLITE_OPEN_NOMUTEX: a connection is
+     *  only ever used by one thread at a time (readers are checked out,
+     *  the writer is locked), so sqlite's own locking is not needed.
+     */
+    class connection_pool
+    : boost::noncopyable
+    {
+    public:
+        connection_pool(const std::string& file, std::size_t size, int busy_timeout = 5000);
+        ~connection_pool();
+        
+        // Blocks until a reader is free
+        database& acquire();
+        void release(database& db);
+        
+        // The writer; lock writer_mutex() while using it
+        database& writer()
+        {
+            return *writer_;
+        }
+        
+        boost::mutex& writer_mutex()
+        {
+            return writer_mtx_;
+        }
+        
+        std::size_t size() const
+        {
+            return all_.size();
+        }
+        
+    private:
+        database* open(const std::string& file, int flags, int busy_timeout);
+        
+        boost::mutex mtx_;
+        boost::condition_variable cond_;
+        std::vector<database*> all_;
+        std::vector<database*> free_;
+        
+        boost::mutex writer_mtx_;
+        database* writer_;
+    };
+    
+    /*
+     *  CONNECTION SCOPE
+     *  Binds a connection to the calling thread; every dao used by this
+     *  thread goes through it until the scope ends. Either a connection
+     *  checked out of a pool (returned on destruction) or a given one.
+     *  Scopes nest; without one daos use the connection they were
+     *  initialized with. The statements prepared on a given connection
+     *  are finalized when the last scope binding it ends, so nothing
+     *  taken from a dao in the scope (e.g. a cursor) may outlive it.
+     */
+    class connection_scope
+    : boost::noncopyable
+    {
+    public:
+        explicit connection_scope(connection_pool& pool);
+        explicit connection_scope(database& db);
+        ~connection_scope();
+        
+        static database* current();
+        
+        // Pool of the innermost pooled scope of this thread
+        static connection_pool* pool();
+        
+    private:
+        friend class write_scope;
+        
+        // Binds a connection owned by 'pool' that the caller already holds
+        connection_scope(connection_pool& pool, database& db);
+        
+        static void keep(database*)
+        {
+        }
+        
+        static void keep_pool(connection_pool*)
+        {
+        }
+        
+        static boost::thread_specific_ptr<database> current_;
+        static boost::thread_specific_ptr<connection_pool> pool_tss_;
+        
+        connection_pool* pool_;
+        database& db_;
+        database* previous_;
+        connection_pool* previous_pool_;
+        
+        // db_ belongs to a pool, which drops its statements itself
+        bool pooled_;
+    };
+    
+    /*
+     *  WRITE SCOPE
+     *  Routes the writes of one dao call to the writer of the thread's pool,
+     *  holding the writer for the duration in a BEGIN IMMEDIATE transaction
+     *  (no SQLITE_BUSY half way through). Nested scopes and threads without
+     *  a pool just use the current connection.
+     */
+    class write_scope
+    : boost::noncopyable
+    {
+    public:
+        explicit write_scope(database& fallback);
+        ~write_scope();
+        
+        database& db() const
+        {
+            return db_;
+        }
+        
+        void commit();
+        
+    private:
+        boost::scoped_ptr<boost::mutex::scoped_lock> lock_;
+        boost::scoped_ptr<connection_scope> bind_;
+        boost::scoped_ptr<unit_of_work> work_;
+        database& db_;
+    };
+    
+    /*
+     *  The exception being handled, to be rethrown by another thread.
+     *  boost wraps exceptions it can't clone with a reference count that
+     *  is not thread safe; database and runtime errors are copied instead.
+     */
+    inline boost::exception_ptr current_error()
+    {
+        try
+        {
+            throw;
+        }
+        catch(const database_error& e)
+        {
+            return boost::copy_exception(e);
+        }
+        catch(const std::runtime_error& e)
+        {
+            return boost::copy_exception(e);
+        }
+        catch(...)
+        {
+            return boost::current_exception();
+        }
+    }
+    
+    /*
+     *  WORKER POOL
+     *  Threads running dao calls in the background, each with a reader of
+     *  the pool's own connections (writes go to its writer). Every worker
+     *  has a bounded queue; posting to a full queue blocks, except from
+     *  the pool's own workers (callbacks and resumed coroutines), which
+     *  could otherwise wait on themselves. Tasks with the same key always
+     *  land on the same worker and so run in the order they were posted.
+     */
+    class worker_pool
+    : boost::noncopyable
+    {
+    public:
+        typedef boost::function<void ()> task;
+        
+        worker_pool(const std::string& file, std::size_t threads, std::size_t queue_limit = 1024);
+        
+        // Runs what is already queued, then stops the workers
+        ~worker_pool();
+        
+        // 'key' orders tasks (NULL: any worker)
+        void post(const void* key, const task& t);
+        
+        template<typename R>
+        boost::shared_future<R> submit(const void* key, const boost::function<R ()>& f)
+        {
+            boost::shared_ptr<boost::packaged_task<R> > t(new boost::packaged_task<R>(boost::bind(&worker_pool::guarded<R>, f)));
+            boost::shared_future<R> result(t->get_future());
+            post(key, boost::bind(&boost::packaged_task<R>::operator(), t));
+            return result;
+        }
+        
+        // Same but 'done' is called on the worker with the ready future
+        template<typename R>
+        void submit(const void* key, const boost::function<R ()>& f, const boost::function<void (boost::shared_future<R>)>& done)
+        {
+            boost::shared_ptr<boost::packaged_task<R> > t(new boost::packaged_task<R>(boost::bind(&worker_pool::guarded<R>, f)));
+            boost::shared_future<R> result(t->get_future());
+            post(key, boost::bind(&worker_pool::complete<R>, t, result, done));
+        }
+        
+        std::size_t size() const
+        {
+            return queues_.size();
+        }
+        
+    private:
+        struct queue
+        {
+            boost::mutex mtx;
+            boost::condition_variable not_empty;
+            boost::condition_variable not_full;
+            std::deque<task> tasks;
+            bool stop;
+            
+            queue()
+            : stop(false)
             {
-                std::string val;
-                getter >> val;
-                return boost::any(val);
             }
-            else if((*it)->def.type() == typeid(sql_date))
+        };
+        
+        // Hands errors to the future through current_error()
+        template<typename R>
+        static R guarded(const boost::function<R ()>& f)
+        {
+            try
             {
-                std::string val;
-                getter >> val;
-                return boost::any(sql_date(val));
+                return f();
             }
-            else
+            catch(...)
             {
-                // Should not happen.
-                throw std::runtime_error("Field of unknown type");
+                boost::rethrow_exception(current_error());
             }
         }
         
-        static database* db_;
-        
-    public:
+        template<typename R>
+        static void complete(boost::shared_ptr<boost::packaged_task<R> > t, boost::shared_future<R> result,
+            boost::function<void (boost::shared_future<R>)> done)
+        {
+            (*t)();
+            done(result);
+        }
+        
+        void run(queue* q);
+        
+        static void keep(worker_pool*)
+        {
+        }
+        
+        // Pool of the calling worker thread
+        static boost::thread_specific_ptr<worker_pool> current_;
+        
+        connection_pool pool_;
+        std::size_t limit_;
+        std::vector<queue*> queues_;
+        boost::thread_group threads_;
+        
+        boost::mutex next_mtx_;
+        std::size_t next_;
+    };
+    
+    /*
+     *  WRITE BEHIND
+     *  Group commit for many concurrent savers. Writes are pushed onto a
+     *  lock-free queue; a single thread with its own connection takes
+     *  whatever has queued up (at most 'max_batch'), runs it in one
+     *  transaction and commits once. Each write gets a ticket (future)
+     *  which is ready when its batch is durable or failed. A write that
+     *  fails is rolled back on its own and does not spoil the batch.
+     *  Objects of failed writes get their id__ and dirty fields back, so
+     *  queueing them again writes them again.
+     */
+    class write_behind
+    : boost::noncopyable
+    {
+    public:
+        typedef boost::function<void ()> task;
+        
+        write_behind(const std::string& file, std::size_t max_batch = 1000, int idle_wait_ms = 10, int busy_timeout = 5000);
+        
+        // Commits everything still queued, then stops the thread
+        ~write_behind();
+        
+        boost::shared_future<void> enqueue(const task& write);
+        
+        // Committed batches so far
+        std::size_t batches() const
+        {
+            return batches_;
+        }
+        
+    private:
+        struct job
+        {
+            task write;
+            boost::promise<void> done;
+        };
+        
+        void run();
+        void commit(std::vector<job*>& batch);
+        
+        database db_;
+        std::size_t max_batch_;
+        int idle_wait_ms_;
+        
+        boost::lockfree::queue<job*> queue_;
+        boost::atomic<bool> stop_;
+        boost::atomic<std::size_t> batches_;
+        
+        boost::mutex mtx_;
+        boost::condition_variable wake_;
+        boost::thread thread_;
+    };
+    
+    /*
+     *  Statement caches of daos for connections other than their own.
+     *  Dropped by the pool before it closes a connection, and for other
+     *  connections when the last connection_scope binding them ends (the
+     *  address may be reused by a new connection later on).
+     */
+    class connection_caches
+    {
+    public:
+        static statement_cache& get(database& db, const void* owner);
+        static void drop(database& db);
+        
+        // Counts the connection_scopes binding 'db'
+        static void bind(database& db);
+        static void unbind(database& db);
+        
+    private:
+        typedef std::map<std::pair<database*, const void*>, statement_cache*> map_type;
+        
+        static void drop_locked(database& db);
+        
+        static boost::mutex mtx_;
+        static map_type caches_;
+        static std::map<database*, int> scopes_;
+    };
+    
+    struct sql_date
+    {
+        sqlite3_int64 value;
+        std::string svalue;
+        
+        sql_date(sqlite3_int64 v)
+        : value(v)
+        {}
+        
+        sql_date(const std::string& v)
+        : svalue(v)
+        {}
+        
+        operator sqlite3_int64() { return value; }
+
+        const std::string to_string() const
+        {
+            if(svalue.empty())
+            {
+                return boost::lexical_cast<std::string>(value);
+            }
+            return svalue;
+        }
+    };
+    
+    /*
+     *  TEXT AND BLOB VIEWS
+     *  Point directly into sqlite's column buffers. Valid only until
+     *  the statement is stepped again.
+     */
+    struct text_view
+    {
+        const char* data;
+        int size;
+        
+        text_view(const char* d, int n)
+        : data(d)
+        , size(n)
+        {}
+        
+        const std::string str() const
+        {
+            return std::string(data, size);
+        }
+        
+        bool operator ==(const text_view& o) const
+        {
+            return size == o.size && std::equal(data, data+size, o.data);
+        }
+        
+        bool operator ==(const std::string& s) const
+        {
+            return static_cast<std::size_t>(size) == s.size() && std::equal(data, data+size, s.data());
+        }
+        
+        bool operator !=(const std::string& s) const
+        {
+            return !(*this == s);
+        }
+    };
+    
+    struct blob_view
+    {
+        const void* data;
+        int size;
+        
+        blob_view(const void* d, int n)
+        : data(d)
+        , size(n)
+        {}
+    };
+    
+    /*
+     *  ROW VIEW
+     *  Read-only access to the current row of a dao query without
+     *  hydrating an object. Column 0 is id__, fields follow in order.
+     */
+    class row_view
+    {
+    public:
+        explicit row_view(query::rows row)
+        : row_(row)
+        {}
+        
+        bool is_null(int idx) const
+        {
+            return row_.column_type(idx) == SQLITE_NULL;
+        }
+        
+        // SQLITE_INTEGER, SQLITE_FLOAT, SQLITE_TEXT, SQLITE_BLOB or SQLITE_NULL
+        int type(int idx) const
+        {
+            return row_.column_type(idx);
+        }
+        
+        template<typename V>
+        V get(int idx) const
+        {
+            return row_.get<V>(idx);
+        }
+        
+        text_view text(int idx) const
+        {
+            const char* d = row_.get<const char*>(idx);
+            return text_view(d ? d : "", row_.column_bytes(idx));
+        }
+        
+        blob_view blob(int idx) const
+        {
+            const void* d = row_.get<const void*>(idx);
+            return blob_view(d, row_.column_bytes(idx));
+        }
+        
+    private:
+        query::rows row_;
+    };
+    
+    /*
+     *  INDEX DECLARATIONS
+     *  Models list their indexes in a static indexes(index_set&) function:
+     *
+     *  static void indexes(sqlite::orm::index_set& ix)
+     *  {
+     *      ix.add("name").collate("NOCASE");
+     *      ix.add("user_id, highscore").unique().where("highscore > 0");
+     *  }
+     *
+     *  Unnamed indexes are called idx_<table>_<columns> followed by their
+     *  options. Two different indexes of the same name are an error.
+     */
+    struct index_def
+    {
+        std::string columns;
+        std::string name;
+        std::string collation;
+        std::string condition;
+        bool is_unique;
+        
+        explicit index_def(const std::string& cols)
+        : columns(cols)
+        , is_unique(false)
+        {}
+        
+        index_def& unique()
+        {
+            is_unique = true;
+            return *this;
+        }
+        
+        // Applies to every column of the index
+        index_def& collate(const std::string& c)
+        {
+            collation = c;
+            return *this;
+        }
+        
+        // Makes a partial index
+        index_def& where(const std::string& expr)
+        {
+            condition = expr;
+            return *this;
+        }
+        
+        index_def& named(const std::string& n)
+        {
+            name = n;
+            return *this;
+        }
+        
+        // 'name' or one made of the table, columns and options
+        const std::string index_name(const std::string& table) const;
+        const std::string sql(const std::string& table) const;
+    };
+    
+    class index_set
+    {
+    public:
+        index_def& add(const std::string& columns)
+        {
+            defs_.push_back(index_def(columns));
+            return defs_.back();
+        }
+        
+        const std::list<index_def>& defs() const
+        {
+            return defs_;
+        }
+        
+    private:
+        std::list<index_def> defs_;
+    };
+    
+    struct base_model;
+    
+    /*
+     *  Typed value binding and reading.
+     *  The key is either a parameter index or a parameter name.
+     */
+    template<typename K>
+    int bind_value(statement& st, K key, int v)
+    {
+        return st.bind(key, v);
+    }
+    
+    template<typename K>
+    int bind_value(statement& st, K key, long v)
+    {
+        return st.bind(key, static_cast<long long>(v));
+    }
+    
+    template<typename K>
+    int bind_value(statement& st, K key, long long v)
+    {
+        return st.bind(key, v);
+    }
+    
+    template<typename K>
+    int bind_value(statement& st, K key, double v)
+    {
+        return st.bind(key, v);
+    }
+    
+    template<typename K>
+    int bind_value(statement& st, K key, bool v)
+    {
+        return st.bind(key, v ? 1 : 0);
+    }
+    
+    // Text is not copied by sqlite; it must live until the statement is stepped
+    template<typename K>
+    int bind_value(statement& st, K key, const std::string& v)
+    {
+        return st.bind(key, v.c_str());
+    }
+    
+    // String literals would otherwise convert to bool; copied by sqlite
+    template<typename K>
+    int bind_value(statement& st, K key, const char* v)
+    {
+        return st.bind(key, v, false);
+    }
+    
+    // Same as bind_value but text is copied; for statements stepped after
+    // the bound value may be gone (cursors)
+    template<typename K, typename V>
+    int bind_copy(statement& st, K key, const V& v)
+    {
+        return bind_value(st, key, v);
+    }
+    
+    template<typename K>
+    int bind_copy(statement& st, K key, const std::string& v)
+    {
+        return st.bind(key, v.c_str(), false);
+    }
+    
+    template<typename K>
+    int bind_value(statement& st, K key, const sql_date& v)
+    {
+        return st.bind(key, wrap_type(v).c_str(), false);
+    }
+    
+    inline void read_value(query::rows::getstream& getter, int& v)
+    {
+        getter >> v;
+    }
+    
+    inline void read_value(query::rows::getstream& getter, long& v)
+    {
+        sqlite3_int64 val;
+        getter >> val;
+        v = static_cast<long>(val);
+    }
+    
+    inline void read_value(query::rows::getstream& getter, long long& v)
+    {
+        getter >> v;
+    }
+    
+    inline void read_value(query::rows::getstream& getter, double& v)
+    {
+        getter >> v;
+    }
+    
+    inline void read_value(query::rows::getstream& getter, bool& v)
+    {
+        int val;
+        getter >> val;
+        v = val != 0;
+    }
+    
+    inline void read_value(query::rows::getstream& getter, std::string& v)
+    {
+        const char* val;
+        getter >> val;
+        v = val ? val : "";
+    }
+    
+    inline void read_value(query::rows::getstream& getter, sql_date& v)
+    {
+        std::string val;
+        read_value(getter, val);
+        v = sql_date(val);
+    }
+    
+    // Reads consecutive columns into the elements of a boost::tuple
+    inline void read_tuple(query::rows::getstream&, const boost::tuples::null_type&)
+    {
+    }
+    
+    template<typename H, typename Tl>
+    void read_tuple(query::rows::getstream& getter, boost::tuples::cons<H, Tl>& t)
+    {
+        read_value(getter, t.get_head());
+        read_tuple(getter, t.get_tail());
+    }
+    
+    /*
+     *  FIELD DESCRIPTOR
+     *  One static instance per model field. Knows the column name/type
+     *  and the offset of the typed member inside the model object.
+     */
+    struct base_field
+    {
+        int offset;
+        int index;
+        bool indexed;
+        
+        base_field(const std::string& name, const std::string& type, bool idx = false)
+        : offset(0)
+        , index(-1)
+        , indexed(idx)
+        , name_(name)
+        , type_(type)
+        {
+        }
+        
+        virtual ~base_field()
+        {
+        }
+        
+        const std::string& get_name() const
+        {
+            return name_;
+        }
+        
+        const std::string& get_type() const
+        {
+            return type_;
+        }
+        
+        virtual int bind(statement& st, int idx, char* base) = 0;
+        virtual void read(query::rows::getstream& getter, char* base) = 0;
+        
+    private:
+        std::string name_;
+        std::string type_;
+    };
+    
+    template<typename V>
+    struct field
+    : public base_field
+    {
+        field(const std::string& name, const std::string& type, bool idx = false)
+        : base_field(name, type, idx)
+        {
+        }
+        
+        V& value_of(char* base)
+        {
+            return *reinterpret_cast<V*>(base + offset);
+        }
+        
+        int bind(statement& st, int idx, char* base)
+        {
+            return bind_value(st, idx, value_of(base));
+        }
+        
+        void read(query::rows::getstream& getter, char* base)
+        {
+            read_value(getter, value_of(base));
+        }
+    };
+    
+    /*
+     *  QUERY EXPRESSIONS
+     *  Typed conditions over model columns, e.g.
+     *      where(score::col_highscore() >= 100000 && score::col_user_id() == id)
+     *  The shape of a condition is its type, so its SQL is generated once
+     *  per shape; values are bound by position with their static types.
+     */
+    template<typename E>
+    struct expr
+    {
+        const E& self() const
+        {
+            return static_cast<const E&>(*this);
+        }
+        
+        // SQL of this shape, built once
+        static const std::string& sql()
+        {
+            static const std::string s = E::make_sql();
+            return s;
+        }
+    };
+    
+    // F is a field struct generated by the FIELD_ macros (or id_field)
+    template<typename F>
+    struct column
+    {
+        typedef typename F::data_type data_type;
+        
+        static const std::string& name()
+        {
+            return F::descriptor().get_name();
+        }
+    };
+    
+    struct id_field
+    {
+        typedef sqlite3_int64 data_type;
+        
+        static const base_field& descriptor()
+        {
+            static field<sqlite3_int64> f("id__", "INTEGER");
+            return f;
+        }
+    };
+    
+    struct op_eq { static const char* sql() { return " = ?"; } };
+    struct op_ne { static const char* sql() { return " <> ?"; } };
+    struct op_lt { static const char* sql() { return " < ?"; } };
+    struct op_le { static const char* sql() { return " <= ?"; } };
+    struct op_gt { static const char* sql() { return " > ?"; } };
+    struct op_ge { static const char* sql() { return " >= ?"; } };
+    
+    template<typename F, typename Op>
+    struct compare
+    : public expr<compare<F, Op> >
+    {
+        typename F::data_type value;
+        
+        explicit compare(const typename F::data_type& v)
+        : value(v)
+        {
+        }
+        
+        static std::string make_sql()
+        {
+            return column<F>::name() + Op::sql();
+        }
+        
+        void bind(statement& st, int& idx) const
+        {
+            bind_value(st, idx++, value);
+        }
+    };
+    
+    template<typename L, typename R>
+    struct logical_and
+    : public expr<logical_and<L, R> >
+    {
+        L l;
+        R r;
+        
+        logical_and(const L& a, const R& b)
+        : l(a)
+        , r(b)
+        {
+        }
+        
+        static std::string make_sql()
+        {
+            return "(" + L::make_sql() + " AND " + R::make_sql() + ")";
+        }
+        
+        void bind(statement& st, int& idx) const
+        {
+            l.bind(st, idx);
+            r.bind(st, idx);
+        }
+    };
+    
+    template<typename L, typename R>
+    struct logical_or
+    : public expr<logical_or<L, R> >
+    {
+        L l;
+        R r;
+        
+        logical_or(const L& a, const R& b)
+        : l(a)
+        , r(b)
+        {
+        }
+        
+        static std::string make_sql()
+        {
+            return "(" + L::make_sql() + " OR " + R::make_sql() + ")";
+        }
+        
+        void bind(statement& st, int& idx) const
+        {
+            l.bind(st, idx);
+            r.bind(st, idx);
+        }
+    };
+    
+#define SQLITE_ORM_COMPARE(op, tag) \
+    template<typename F> \
+    compare<F, tag> operator op(const column<F>&, const typename F::data_type& v) \
+    { \
+        return compare<F, tag>(v); \
+    }
+    
+    SQLITE_ORM_COMPARE(==, op_eq)
+    SQLITE_ORM_COMPARE(!=, op_ne)
+    SQLITE_ORM_COMPARE(<, op_lt)
+    SQLITE_ORM_COMPARE(<=, op_le)
+    SQLITE_ORM_COMPARE(>, op_gt)
+    SQLITE_ORM_COMPARE(>=, op_ge)
+    
+#undef SQLITE_ORM_COMPARE
+    
+    template<typename L, typename R>
+    logical_and<L, R> operator &&(const expr<L>& a, const expr<R>& b)
+    {
+        return logical_and<L, R>(a.self(), b.self());
+    }
+    
+    template<typename L, typename R>
+    logical_or<L, R> operator ||(const expr<L>& a, const expr<R>& b)
+    {
+        return logical_or<L, R>(a.self(), b.self());
+    }
+    
+    // Reads better at the call site: dao<score>::query_all(where(...))
+    template<typename E>
+    const E& where(const expr<E>& e)
+    {
+        return e.self();
+    }
+    
+    struct base_foreign_collection
+    {
+        int offset;
+        virtual void save(base_model&) = 0;
+        virtual void remove(base_model&) = 0;
+        
+        // Deletes the children of all owners selected by the 'owners' subquery
+        virtual void remove_owned(const std::string& owners, sqlite3_int64 owner) = 0;
+        
+        // The owner's rows are gone; saving the loaded children writes them again
+        virtual void mark_removed(base_model&) = 0;
+    };
+    
+    template<typename T>
+    struct foreign_collection
+    : public base_foreign_collection
+    {
+        std::vector<T> collection;
+        void save(base_model&) = 0;
+        void remove(base_model&) = 0;
+        void remove_owned(const std::string&, sqlite3_int64) = 0;
+        void mark_removed(base_model&) = 0;
+    };
+    
+    template<typename T>
+    class cursor;
+    
+    /*
+     *  PAGE
+     *  One page of a keyset paginated query. 'next' is the continuation
+     *  token for the following page and is empty on the last page.
+     */
+    template<typename T>
+    struct page
+    {
+        std::vector<boost::shared_ptr<T> > items;
+        std::string next;
+    };
+    
+    template<typename T>
+    class dao;
+    
+    /*
+     *  Helpers for queries scoped to the children of one HAS_MANY owner.
+     *  The extra condition (if any) is AND-ed to the foreign key match.
+     */
+    inline std::string owned_where(const std::string& fk, const std::string& cond)
+    {
+        std::string w = "WHERE " + fk + " = :owner__";
+        if(!cond.empty())
+        {
+            w.append(" AND (").append(cond).append(")");
+        }
+        return w;
+    }
+    
+    inline std::map<std::string, boost::any> owned_args(std::map<std::string, boost::any> args, sqlite3_int64 owner)
+    {
+        args[":owner__"] = owner;
+        return args;
+    }
+    
+    /*
+     *  Owner remembered by a BELONGS_TO field. Copies start empty, so the
+     *  children copied into the owner's own collections never keep the
+     *  owner alive (a shared_ptr cycle).
+     */
+    template<typename T>
+    struct owner_memo
+    {
+        owner_memo()
+        {
+        }
+        
+        owner_memo(const owner_memo&)
+        {
+        }
+        
+        owner_memo& operator=(const owner_memo&)
+        {
+            ptr.reset();
+            return *this;
+        }
+        
+        boost::shared_ptr<T> ptr;
+    };
+    
+    // Delays naming dao<T> in inline macro templates until T is complete
+    template<typename T, typename>
+    struct late
+    {
+        typedef T type;
+    };
+    
+    /*
+     *  CHANGE HOOKS
+     *  sqlite3pp keeps one update and one rollback handler per database.
+     *  change_hooks installs them once and fans the events out to all
+     *  subscribed listeners. Setting other handlers on the same database
+     *  directly replaces this dispatch.
+     *  Some changes never reach the update hook (DELETE without WHERE,
+     *  WITHOUT ROWID tables, rolling back to a savepoint); sync() tells
+     *  the listeners to drop everything when sqlite counted more changes
+     *  than the hook reported.
+     *  The registry is shared by all threads. Subscribe while no other
+     *  thread is using that connection.
+     */
+    struct change_listener
+    {
+        virtual ~change_listener()
+        {
+        }
+        
+        virtual void on_update(const char* table, sqlite3_int64 rowid) = 0;
+        virtual void on_rollback() = 0;
+    };
+    
+    class change_hooks
+    {
+    public:
+        static void subscribe(database& db, change_listener* l);
+        static void unsubscribe(database& db, change_listener* l);
+        
+        static void sync(database& db);
+        
+        // Listeners of 'db' forget everything, as after a rollback
+        static void invalidate(database& db);
+        
+    private:
+        struct hooked
+        {
+            std::vector<change_listener*> listeners;
+            
+            // sqlite3_total_changes as the update hook accounts for it
+            int changes;
+            
+            hooked()
+            : changes(0)
+            {}
+        };
+        
+        typedef std::map<database*, hooked> map_type;
+        
+        static map_type& listeners();
+        static boost::mutex& mutex();
+        static void on_update(database* db, int op, char const* dbname, char const* table, long long rowid);
+        static void on_rollback(database* db);
+    };
+    
+    /*
+     *  OBJECT CACHE
+     *  Size bounded LRU of hydrated objects by id__. Entries are dropped
+     *  precisely by the update hook and all at once on rollback, on
+     *  changes the hook missed or when PRAGMA data_version reports a
+     *  commit from another connection. Safe to share between threads.
+     */
+    template<typename T>
+    class object_cache
+    : public change_listener
+    , boost::noncopyable
+    {
+    public:
+        object_cache()
+        : capacity_(0)
+        , version_(-1)
+        , hits_(0)
+        , misses_(0)
+        , evictions_(0)
+        {
+        }
+        
+        bool enabled() const
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            return capacity_ > 0;
+        }
+        
+        void configure(const std::string& table, std::size_t capacity)
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            table_ = table;
+            capacity_ = capacity;
+            trim();
+        }
+        
+        boost::shared_ptr<T> get(sqlite3_int64 id)
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            typename index_type::iterator it = index_.find(id);
+            if(it == index_.end())
+            {
+                ++misses_;
+                return boost::shared_ptr<T>();
+            }
+            
+            ++hits_;
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return *it->second;
+        }
+        
+        void put(const T& obj)
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            drop(obj.get_id());
+            lru_.push_front(boost::shared_ptr<T>(new T(obj)));
+            index_[obj.get_id()] = lru_.begin();
+            trim();
+        }
+        
+        void erase(sqlite3_int64 id)
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            drop(id);
+        }
+        
+        void clear()
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            drop_all();
+        }
+        
+        // Drops everything if the data_version changed since the last call
+        void sync(sqlite3_int64 version)
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            if(version != version_)
+            {
+                drop_all();
+                version_ = version;
+            }
+        }
+        
+        void on_update(const char* table, sqlite3_int64 rowid)
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            if(table_ == table)
+            {
+                drop(rowid);
+            }
+        }
+        
+        void on_rollback()
+        {
+            clear();
+        }
+        
+        std::size_t size() const
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            return index_.size();
+        }
+        
+        std::size_t hits() const
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            return hits_;
+        }
+        
+        std::size_t misses() const
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            return misses_;
+        }
+        
+        std::size_t evictions() const
+        {
+            boost::mutex::scoped_lock lock(mtx_);
+            return evictions_;
+        }
+        
+    private:
+        typedef std::list<boost::shared_ptr<T> > list_type;
+        typedef std::map<sqlite3_int64, typename list_type::iterator> index_type;
+        
+        // Callers hold mtx_
+        void drop(sqlite3_int64 id)
+        {
+            typename index_type::iterator it = index_.find(id);
+            if(it != index_.end())
+            {
+                lru_.erase(it->second);
+                index_.erase(it);
+            }
+        }
+        
+        void drop_all()
+        {
+            lru_.clear();
+            index_.clear();
+        }
+        
+        void trim()
+        {
+            while(index_.size() > capacity_)
+            {
+                index_.erase(lru_.back()->get_id());
+                lru_.pop_back();
+                ++evictions_;
+            }
+        }
+        
+        mutable boost::mutex mtx_;
+        std::string table_;
+        std::size_t capacity_;
+        sqlite3_int64 version_;
+        list_type lru_;
+        index_type index_;
+        std::size_t hits_;
+        std::size_t misses_;
+        std::size_t evictions_;
+    };
+    
+    // Only integral keys can be primary key lookups
+    template<typename V>
+    bool to_rowid(const V&, sqlite3_int64&)
+    {
+        return false;
+    }
+    
+    inline bool to_rowid(int v, sqlite3_int64& id)
+    {
+        id = v;
+        return true;
+    }
+    
+    inline bool to_rowid(long v, sqlite3_int64& id)
+    {
+        id = v;
+        return true;
+    }
+    
+    inline bool to_rowid(long long v, sqlite3_int64& id)
+    {
+        id = v;
+        return true;
+    }
+    
+    /*
+     *  SESSION
+     *  Opt-in unit of work. While a session is alive every object loaded
+     *  through dao queries is kept in an identity map keyed by
+     *  (table name, id__) and the same instance is returned for the same
+     *  row. flush() saves all dirty objects in one transaction.
+     */
+    class session
+    : boost::noncopyable
+    {
+    public:
+        explicit session(database& db);
+        ~session();
+        
+        // Innermost live session or NULL
+        static session* current();
+        
+        template<typename T>
+        boost::shared_ptr<T> find(sqlite3_int64 id) const
+        {
+            map_type::const_iterator it = objects_.find(key(T::table_name(), id));
+            if(it == objects_.end())
+            {
+                return boost::shared_ptr<T>();
+            }
+            return boost::static_pointer_cast<T>(it->second.obj);
+        }
+        
+        // Starts tracking an object; new objects are saved by flush()
+        template<typename T>
+        void attach(const boost::shared_ptr<T>& obj)
+        {
+            entry e;
+            e.obj = obj;
+            e.table = T::table_name();
+            e.id = &ops<T>::id;
+            e.dirty = &ops<T>::dirty;
+            e.save = &ops<T>::save;
+            
+            if(obj->get_id() == -1)
+            {
+                new_.push_back(e);
+            }
+            else
+            {
+                objects_[key(T::table_name(), obj->get_id())] = e;
+            }
+        }
+        
+        template<typename T>
+        void evict(sqlite3_int64 id)
+        {
+            objects_.erase(key(T::table_name(), id));
+        }
+        
+        void flush();
+        void clear();
+        
+        std::size_t size() const
+        {
+            return objects_.size() + new_.size();
+        }
+        
+    private:
+        template<typename T>
+        struct ops
+        {
+            static sqlite3_int64 id(void* p)
+            {
+                return static_cast<T*>(p)->get_id();
+            }
+            
+            static bool dirty(void* p)
+            {
+                return static_cast<T*>(p)->is_dirty() || static_cast<T*>(p)->get_id() == -1;
+            }
+            
+            static void save(void* p)
+            {
+                dao<T>::save(*static_cast<T*>(p));
+            }
+        };
+        
+        struct entry
+        {
+            boost::shared_ptr<void> obj;
+            std::string table;
+            sqlite3_int64 (*id)(void*);
+            bool (*dirty)(void*);
+            void (*save)(void*);
+        };
+        
+        typedef std::pair<std::string, sqlite3_int64> key_type;
+        typedef std::map<key_type, entry> map_type;
+        
+        static key_type key(const std::string& table, sqlite3_int64 id)
+        {
+            return key_type(table, id);
+        }
+        
+        static void keep(session*)
+        {
+        }
+        
+        static boost::thread_specific_ptr<session> current_;
+        
+        database& db_;
+        session* previous_;
+        map_type objects_;
+        std::vector<entry> new_;
+    };
+    
+    /*
+     *  RESULT SET
+     *  Owns the objects of one query result. Objects are constructed in
+     *  a few monotonically growing blocks and all destroyed together.
+     *  clear() keeps the blocks for the next query.
+     */
+    template<typename T>
+    class result_set
+    : boost::noncopyable
+    {
+    public:
+        explicit result_set(std::size_t first_block = 64)
+        : first_block_(std::max<std::size_t>(1, first_block))
+        , current_(0)
+        , used_(0)
+        {
+        }
+        
+        ~result_set()
+        {
+            clear();
+            for(typename std::vector<block>::iterator it = blocks_.begin(); it != blocks_.end(); ++it)
+            {
+                ::operator delete(it->first);
+            }
+        }
+        
+        std::size_t size() const
+        {
+            return rows_.size();
+        }
+        
+        bool empty() const
+        {
+            return rows_.empty();
+        }
+        
+        T& operator[](std::size_t i) const
+        {
+            return *rows_[i];
+        }
+        
+        // Constructs a new default object at the end of the arena
+        T& create()
+        {
+            if(blocks_.empty() || used_ == blocks_[current_].second)
+            {
+                if(!blocks_.empty() && current_ + 1 < blocks_.size())
+                {
+                    ++current_;
+                }
+                else
+                {
+                    std::size_t n = blocks_.empty() ? first_block_ : blocks_.back().second * 2;
+                    blocks_.push_back(block(static_cast<T*>(::operator new(n * sizeof(T))), n));
+                    current_ = blocks_.size() - 1;
+                }
+                used_ = 0;
+            }
+            
+            // grow before constructing so push_back below cannot throw
+            if(rows_.size() == rows_.capacity())
+            {
+                rows_.reserve(std::max<std::size_t>(first_block_, rows_.size() * 2));
+            }
+            
+            T* obj = new (blocks_[current_].first + used_) T;
+            ++used_;
+            rows_.push_back(obj);
+            return *obj;
+        }
+        
+        void clear()
+        {
+            for(typename std::vector<T*>::reverse_iterator it = rows_.rbegin(); it != rows_.rend(); ++it)
+            {
+                (*it)->~T();
+            }
+            rows_.clear();
+            current_ = 0;
+            used_ = 0;
+        }
+        
+    private:
+        typedef std::pair<T*, std::size_t> block;
+        
+        std::vector<block> blocks_;
+        std::vector<T*> rows_;
+        std::size_t first_block_;
+        std::size_t current_;
+        std::size_t used_;
+    };
+    
+    template<typename T>
+    class dao
+    : public base_dao
+    , public T
+    {
+    private:
+        friend class sqlite::orm::cursor<T>;
+        
+
+        void init(database& db)
+        {
+            static bool _init = false;
+            if(!_init)
+            {
+                // Database is set only once
+                db_ = &db;
+                
+                // Create this table in DB
+                std::string q = "CREATE TABLE IF NOT EXISTS ";
+                q.append(T::table_name()).append(" (id__ INTEGER PRIMARY KEY AUTOINCREMENT, ");
+                for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
+                    it != T::fields_.end(); ++it)
+                {
+                    q.append((*it)->get_name());
+                    q.append(" ").append((*it)->get_type());
+                    if(it+1 != T::fields_.end())
+                    {
+                        q.append(", ");
+                    }
+                }
+                q.append(")");
+                
+#ifdef DEBUG_SQL
+                std::cout << q << "\n";
+#endif
+                db_->execute(q.c_str());
+                
+                create_indexes();
+                build_sql();
+                
+                _init = true;
+            }
+        }
+        
+        static void create_indexes()
+        {
+            index_set ix;
+            
+            // foreign keys are always indexed
+            for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
+                it != T::fields_.end(); ++it)
+            {
+                if((*it)->indexed)
+                {
+                    ix.add((*it)->get_name());
+                }
+            }
+            
+            T::indexes(ix);
+            
+            // IF NOT EXISTS would silently skip a different index of the same name
+            std::map<std::string, std::string> made;
+            for(std::list<index_def>::const_iterator it = ix.defs().begin(); it != ix.defs().end(); ++it)
+            {
+                const std::string q = it->sql(T::table_name());
+                
+                std::string& same = made[it->index_name(T::table_name())];
+                if(same == q)
+                {
+                    continue;
+                }
+                if(!same.empty())
+                {
+                    throw std::runtime_error("Duplicate index name: " + it->index_name(T::table_name()));
+                }
+                same = q;
+                
+#ifdef DEBUG_SQL
+                std::cout << q << "\n";
+#endif
+                if(db_->execute(q.c_str()) != SQLITE_OK)
+                {
+                    throw database_error(*db_);
+                }
+            }
+        }
+        
+        static database* db_;
+        static bool atomic_;
+        static statement_cache cache_;
+        static object_cache<T> objects_;
+        
+        static std::string select_sql_;
+        static std::string save_sql_;
+        
+        // Columns are bound by position: id__ is 1, then the fields
+        // in the order of T::fields_.
+        static std::vector<int> save_params_;
+        
+        // The connection bound to this thread, if any, else our own
+        static database& db()
+        {
+            database* bound = connection_scope::current();
+            return bound ? *bound : *db_;
+        }
+        
+        static statement_cache& cache()
+        {
+            database& d = db();
+            return &d == db_ ? cache_ : connection_caches::get(d, &cache_);
+        }
+        
+        static void build_sql()
+        {
+            std::string columns = "id__";
+            std::string values = ":id__";
+            std::string updates;
+            
+            save_params_.clear();
+            for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
+                it != T::fields_.end(); ++it)
+            {
+                columns.append(", ").append((*it)->get_name());
+                values.append(", :").append((*it)->get_name());
+                updates.append(updates.empty() ? "" : ", ").append((*it)->get_name()).append(" = excluded.").append((*it)->get_name());
+                save_params_.push_back(static_cast<int>(it - T::fields_.begin()) + 2);
+            }
+            
+            select_sql_ = "SELECT " + columns + " FROM " + T::table_name();
+            
+            // a true upsert: an existing row is updated in place, not deleted and reinserted
+            save_sql_ = "INSERT INTO " + T::table_name() + " (" + columns + ") VALUES (" + values + ")"
+                + " ON CONFLICT(id__) DO " + (updates.empty() ? "NOTHING" : "UPDATE SET " + updates)
+                + " RETURNING id__";
+        }
+        
+        static void hydrate(query::rows row, T& out)
+        {
+            query::rows::getstream getter = row.getter();
+            getter >> out.id__;
+            
+            char* base = (char*)&out;
+            for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
+                it != T::fields_.end(); ++it)
+            {
+                (*it)->read(getter, base);
+            }
+            
+            out.mark_clean();
+        }
+        
+        template<typename F>
+        static std::size_t visit_rows(query& qry, F& f)
+        {
+            std::size_t cnt = 0;
+            for (sqlite3pp::query::iterator i = qry.begin(); i != qry.end(); ++i, ++cnt)
+            {
+                f(row_view(*i));
+            }
+            return cnt;
+        }
+        
+        // Objects from the object cache are handed out as copies
+        static boost::shared_ptr<T> adopt(const T& cached)
+        {
+            session* s = session::current();
+            if(s)
+            {
+                boost::shared_ptr<T> known = s->find<T>(cached.get_id());
+                if(known)
+                {
+                    return known;
+                }
+            }
+            
+            boost::shared_ptr<T> out = boost::shared_ptr<T>(new T(cached));
+            if(s)
+            {
+                s->attach(out);
+            }
+            return out;
+        }
+        
+        // Catches up on writes the update hook didn't report, by this
+        // connection (change counts) or others (data_version)
+        static void sync_objects()
+        {
+            change_hooks::sync(db());
+            
+            cached_statement<query> qry(cache(), "data_version");
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), "PRAGMA data_version");
+            }
+            
+            for (sqlite3pp::query::iterator i = qry->begin(); i != qry->end(); ++i)
+            {
+                objects_.sync((*i).get<long long>(0));
+            }
+        }
+        
+        // Single scalar result; NULL (e.g. MAX over no rows) reads as V()
+        template<typename V>
+        static V aggregate(const std::string& expr, const std::string& where, const std::map<std::string, boost::any>& args)
+        {
+            cached_statement<query> qry(cache(), "agg:" + expr + ":" + where);
+            if(!qry.prepared())
+            {
+                std::string q = "SELECT " + expr + " FROM " + T::table_name();
+                if(!where.empty())
+                {
+                    q.append(" ").append(where);
+                }
+                qry.prepare(db(), q);
+            }
+            
+            bind_args(qry, args);
+            
+            V result = V();
+            sqlite3pp::query::iterator i = qry->begin();
+            if(i != qry->end())
+            {
+                query::rows row = *i;
+                query::rows::getstream getter = row.getter();
+                read_value(getter, result);
+            }
+            
+            return result;
+        }
+        
+        static std::vector<sqlite::orm::base_field*> fields_of(const std::string& fields)
+        {
+            std::vector<sqlite::orm::base_field*> result;
+            std::stringstream ss(fields);
+            std::string name;
+            
+            while(std::getline(ss, name, ','))
+            {
+                name.erase(0, name.find_first_not_of(" "));
+                name.erase(name.find_last_not_of(" ") + 1);
+                
+                const int col = column_of(name);
+                if(col < 1)
+                {
+                    throw std::runtime_error("Unknown field in projection: " + name);
+                }
+                result.push_back(T::fields_[col - 1]);
+            }
+            
+            return result;
+        }
+        
+        static std::string projection_sql(const std::vector<sqlite::orm::base_field*>& selected, const std::string& where)
+        {
+            std::string q = "SELECT id__";
+            for(std::vector<sqlite::orm::base_field*>::const_iterator it = selected.begin(); it != selected.end(); ++it)
+            {
+                q.append(", ").append((*it)->get_name());
+            }
+            q.append(" FROM ").append(T::table_name());
+            
+            if(!where.empty())
+            {
+                q.append(" ").append(where);
+            }
+            return q;
+        }
+        
+        static std::string page_token(const row_view& row, int col)
+        {
+            const std::string id = boost::lexical_cast<std::string>(row.get<long long>(0));
+            
+            switch(row.type(col))
+            {
+                case SQLITE_INTEGER:
+                    return "i:" + id + ":" + boost::lexical_cast<std::string>(row.get<long long>(col));
+                case SQLITE_FLOAT:
+                    return "f:" + id + ":" + boost::lexical_cast<std::string>(row.get<double>(col));
+                case SQLITE_NULL:
+                    return "n:" + id + ":";
+                default:
+                    return "t:" + id + ":" + row.text(col).str();
+            }
+        }
+        
+        static std::size_t fill(query& qry, result_set<T>& out)
+        {
+            std::size_t cnt = 0;
+            for (sqlite3pp::query::iterator i = qry.begin(); i != qry.end(); ++i, ++cnt)
+            {
+                hydrate(*i, out.create());
+            }
+            return cnt;
+        }
+        
+        static boost::shared_ptr<T> hydrate(query::rows row)
+        {
+            session* s = session::current();
+            if(s)
+            {
+                // already loaded in this session
+                boost::shared_ptr<T> known = s->find<T>(row.get<long long>(0));
+                if(known)
+                {
+                    return known;
+                }
+            }
+            
+            boost::shared_ptr<T> out = boost::shared_ptr<T>(new T);
+            hydrate(row, *out);
+            
+            if(s)
+            {
+                s->attach(out);
+            }
+            return out;
+        }
+        
+        static void bind_arg(query& qry, int idx, const boost::any& val, bool copy = false)
+        {
+            if(val.type() == typeid(long))
+            {
+                bind_value(qry, idx, boost::any_cast<long>(val));
+            }
+            else if(val.type() == typeid(int))
+            {
+                bind_value(qry, idx, boost::any_cast<int>(val));
+            }
+            else if(val.type() == typeid(sqlite3_int64))
+            {
+                bind_value(qry, idx, boost::any_cast<sqlite3_int64>(val));
+            }
+            else if(val.type() == typeid(double))
+            {
+                bind_value(qry, idx, boost::any_cast<double>(val));
+            }
+            else if(val.type() == typeid(std::string))
+            {
+                const std::string& text = *boost::any_cast<std::string>(&val);
+                if(copy)
+                {
+                    bind_copy(qry, idx, text);
+                }
+                else
+                {
+                    bind_value(qry, idx, text);
+                }
+            }
+            else if(val.type() == typeid(sql_date))
+            {
+                bind_value(qry, idx, boost::any_cast<sql_date>(val));
+            }
+            else
+            {
+                // Should not happen.
+                throw std::runtime_error(std::string("Trying to bind field of unknown type: ") + val.type().name());
+            }
+        }
+        
+        static void bind_args(cached_statement<query>& qry, const std::map<std::string, boost::any>& args, bool copy = false)
+        {
+            statement_cache::params_type& params = qry.params();
+            
+            // resolve parameter positions only if the argument names changed
+            bool same = params.size() == args.size();
+            std::map<std::string, boost::any>::const_iterator it = args.begin();
+            for(statement_cache::params_type::iterator p = params.begin(); same && p != params.end(); ++p, ++it)
+            {
+                same = p->first == it->first;
+            }
+            
+            if(!same)
+            {
+                params.clear();
+                for(it = args.begin(); it != args.end(); ++it)
+                {
+                    params.push_back(std::make_pair(it->first, qry->bind_parameter_index(it->first.c_str())));
+                }
+            }
+            
+            statement_cache::params_type::iterator p = params.begin();
+            for(it = args.begin(); it != args.end(); ++it, ++p)
+            {
+                bind_arg(*qry, p->second, it->second, copy);
+            }
+        }
+        
+    public:
+        
+        dao(database& db)
+        {
+            init(db);
+        }
+        
+        // Prepared statements reused by this dao (hit/miss counters)
+        static const statement_cache& statements()
+        {
+            return cache_;
+        }
+        
+        static void clear_statements()
+        {
+            cache_.clear();
+        }
+        
+        template<typename V>
+        static boost::shared_ptr<T> query_by__fieldname__(std::string fn, V v)
+        {
+            sqlite3_int64 id;
+            // the object cache follows the changes of the dao's own connection only
+            const bool by_id = objects_.enabled() && &db() == db_ && fn == "id__" && to_rowid(v, id);
+            
+            if(by_id)
+            {
+                sync_objects();
+                
+                boost::shared_ptr<T> cached = objects_.get(id);
+                if(cached)
+                {
+                    return adopt(*cached);
+                }
+            }
+            
+            cached_statement<query> qry(cache(), "by:" + fn);
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), select_sql_ + " WHERE " + fn + " = :var");
+            }
+            
+            bind_value(*qry, 1, v);
+            
+            for (sqlite3pp::query::iterator i = qry->begin(); i != qry->end(); ++i)
+            {
+                // return the first result
+                if(by_id)
+                {
+                    // the session's instance may have unsaved changes; cache the row
+                    T clean;
+                    hydrate(*i, clean);
+                    objects_.put(clean);
+                    return adopt(clean);
+                }
+                return hydrate(*i);
+            }
+            
+            // return empty
+            return boost::shared_ptr<T>();
+        }
+        
+        /*
+         *  Second level cache of objects consulted by query_by__fieldname__
+         *  on id__. Takes over the update and rollback hooks of the database.
+         */
+        static void enable_object_cache(std::size_t capacity)
+        {
+            if(!db_)
+            {
+                throw std::runtime_error("enable_object_cache on " + T::table_name() + " needs a dao constructed first");
+            }
+            
+            if(!objects_.enabled())
+            {
+                change_hooks::subscribe(*db_, &objects_);
+            }
+            
+            objects_.configure(T::table_name(), capacity);
+            
+            if(!capacity)
+            {
+                change_hooks::unsubscribe(*db_, &objects_);
+            }
+        }
+        
+        static void disable_object_cache()
+        {
+            enable_object_cache(0);
+        }
+        
+        static const object_cache<T>& objects()
+        {
+            return objects_;
+        }
+        
+        template<typename V>
+        static std::vector<boost::shared_ptr<T> > query_all_by__fieldname__(std::string fn, V v)
+        {
+            cached_statement<query> qry(cache(), "by:" + fn);
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), select_sql_ + " WHERE " + fn + " = :var");
+            }
+            
+            bind_value(*qry, 1, v);
+            
+            std::vector<boost::shared_ptr<T> > result;
+            
+            for (sqlite3pp::query::iterator i = qry->begin(); i != qry->end(); ++i)
+            {
+                result.push_back(hydrate(*i));
+            }
+            
+            return result;
+        }
+        
+        // All rows where 'fn' is one of 'values'. Uses IN lists of at most
+        // SQLITE_MAX_VARIABLE_NUMBER parameters; shorter lists are padded to
+        // a power of two so only a few statements per field get cached.
+        template<typename V>
+        static std::vector<boost::shared_ptr<T> > query_all_in__fieldname__(std::string fn, const std::vector<V>& values)
+        {
+            std::vector<boost::shared_ptr<T> > result;
+            const std::size_t limit = SQLITE_MAX_VARIABLE_NUMBER;
+            
+            for(std::size_t from = 0; from < values.size(); from += limit)
+            {
+                const std::size_t n = std::min(limit, values.size() - from);
+                std::size_t slots = 1;
+                while(slots < n)
+                {
+                    slots *= 2;
+                }
+                slots = std::min(slots, limit);
+                
+                cached_statement<query> qry(cache(), "in:" + fn + ":" + boost::lexical_cast<std::string>(slots));
+                if(!qry.prepared())
+                {
+                    std::string q = select_sql_ + " WHERE " + fn + " IN (";
+                    for(std::size_t i = 0; i < slots; ++i)
+                    {
+                        q.append(i ? ", ?" : "?");
+                    }
+                    q.append(")");
+                    
+                    qry.prepare(db(), q);
+                }
+                
+                for(std::size_t i = 0; i < slots; ++i)
+                {
+                    bind_value(*qry, static_cast<int>(i) + 1, values[from + std::min(i, n - 1)]);
+                }
+                
+                for (sqlite3pp::query::iterator i = qry->begin(); i != qry->end(); ++i)
+                {
+                    result.push_back(hydrate(*i));
+                }
+            }
+            
+            return result;
+        }
+        
+        static boost::shared_ptr<T> query_first()
+        {
+            cached_statement<query> qry(cache(), "first");
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), select_sql_ + " LIMIT 1");
+            }
+            
+            for (sqlite3pp::query::iterator i = qry->begin(); i != qry->end(); ++i)
+            {
+                return hydrate(*i);
+            }
+            
+            return boost::shared_ptr<T>();
+        }
+        
+        static boost::shared_ptr<T> query_first(const std::string& where, const std::map<std::string, boost::any>& args)
+        {
+            cached_statement<query> qry(cache(), "first:" + where);
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), select_sql_ + " " + where + " LIMIT 1");
+            }
+            
+            // bind all arguments
+            bind_args(qry, args);
+            
+            for (sqlite3pp::query::iterator i = qry->begin(); i != qry->end(); ++i)
+            {
+                return hydrate(*i);
+            }
+            
+            return boost::shared_ptr<T>();
+        }
+        
+        static std::vector<boost::shared_ptr<T> > query_all()
+        {
+            cached_statement<query> qry(cache(), "all");
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), select_sql_);
+            }
+            
+            std::vector<boost::shared_ptr<T> > result;
+            
+            for (sqlite3pp::query::iterator i = qry->begin(); i != qry->end(); ++i)
+            {
+                result.push_back(hydrate(*i));
+            }
+            
+            return result;
+        }
+
+        static std::vector<boost::shared_ptr<T> > query_all(const std::string& where, const std::map<std::string, boost::any>& args)
+        {
+            cached_statement<query> qry(cache(), "all:" + where);
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), select_sql_ + " " + where);
+            }
+            
+            // bind all arguments
+            bind_args(qry, args);
+            
+            std::vector<boost::shared_ptr<T> > result;
+            
+            for (sqlite3pp::query::iterator i = qry->begin(); i != qry->end(); ++i)
+            {
+                result.push_back(hydrate(*i));
+            }
+            
+            return result;
+        }
+        
+        // Same as query_all but objects are placed into the arena of 'out'
+        static std::size_t query_all(result_set<T>& out)
+        {
+            cached_statement<query> qry(cache(), "all");
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), select_sql_);
+            }
+            
+            return fill(*qry, out);
+        }
+        
+        static std::size_t query_all(const std::string& where, const std::map<std::string, boost::any>& args, result_set<T>& out)
+        {
+            cached_statement<query> qry(cache(), "all:" + where);
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), select_sql_ + " " + where);
+            }
+            
+            // bind all arguments
+            bind_args(qry, args);
+            
+            return fill(*qry, out);
+        }
+        
+        /*
+         *  Typed conditions, see QUERY EXPRESSIONS above.
+         */
+        template<typename E>
+        static boost::shared_ptr<T> query_first(const expr<E>& cond)
+        {
+            static const std::string key = "expr-first:" + expr<E>::sql();
+            
+            cached_statement<query> qry(cache(), key);
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), select_sql_ + " WHERE " + expr<E>::sql() + " LIMIT 1");
+            }
+            
+            int idx = 1;
+            cond.self().bind(*qry, idx);
+            
+            for (sqlite3pp::query::iterator i = qry->begin(); i != qry->end(); ++i)
+            {
+                return hydrate(*i);
+            }
+            
+            return boost::shared_ptr<T>();
+        }
+        
+        template<typename E>
+        static std::vector<boost::shared_ptr<T> > query_all(const expr<E>& cond)
+        {
+            static const std::string key = "expr-all:" + expr<E>::sql();
+            
+            cached_statement<query> qry(cache(), key);
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), select_sql_ + " WHERE " + expr<E>::sql());
+            }
+            
+            int idx = 1;
+            cond.self().bind(*qry, idx);
+            
+            std::vector<boost::shared_ptr<T> > result;
+            
+            for (sqlite3pp::query::iterator i = qry->begin(); i != qry->end(); ++i)
+            {
+                result.push_back(hydrate(*i));
+            }
+            
+            return result;
+        }
+        
+        /*
+         *  Streaming variants of the above. Rows are hydrated one at a time
+         *  while the cursor is advanced; with 'reuse' the same object is
+         *  refilled for every row.
+         */
+        template<typename V>
+        static cursor<T> cursor_all_by__fieldname__(std::string fn, V v, bool reuse = false)
+        {
+            boost::shared_ptr<cached_statement<query> > qry(new cached_statement<query>(cache(), "by:" + fn));
+            if(!qry->prepared())
+            {
+                qry->prepare(db(), select_sql_ + " WHERE " + fn + " = :var");
+            }
+            
+            // the cursor outlives v
+            bind_copy(**qry, 1, v);
+            
+            return cursor<T>(qry, reuse);
+        }
+        
+        static cursor<T> cursor_all(bool reuse = false)
+        {
+            boost::shared_ptr<cached_statement<query> > qry(new cached_statement<query>(cache(), "all"));
+            if(!qry->prepared())
+            {
+                qry->prepare(db(), select_sql_);
+            }
+            
+            return cursor<T>(qry, reuse);
+        }
+        
+        static cursor<T> cursor_all(const std::string& where, const std::map<std::string, boost::any>& args, bool reuse = false)
+        {
+            boost::shared_ptr<cached_statement<query> > qry(new cached_statement<query>(cache(), "all:" + where));
+            if(!qry->prepared())
+            {
+                qry->prepare(db(), select_sql_ + " " + where);
+            }
+            
+            // bind all arguments; the cursor outlives them
+            bind_args(*qry, args, true);
+            
+            return cursor<T>(qry, reuse);
+        }
+        
+        /*
+         *  Projections. Only the listed fields (comma separated) are
+         *  selected and decoded. Partially loaded objects keep defaults in
+         *  the other fields; since those are not dirty, saving such an object
+         *  never overwrites them. They bypass the session and object cache.
+         */
+        static std::vector<boost::shared_ptr<T> > query_all_partial(const std::string& fields, const std::string& where = "",
+            const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>())
+        {
+            std::vector<sqlite::orm::base_field*> selected = fields_of(fields);
+            
+            cached_statement<query> qry(cache(), "proj:" + fields + ":" + where);
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), projection_sql(selected, where));
+            }
+            
+            bind_args(qry, args);
+            
+            std::vector<boost::shared_ptr<T> > result;
+            for (sqlite3pp::query::iterator i = qry->begin(); i != qry->end(); ++i)
+            {
+                boost::shared_ptr<T> out = boost::shared_ptr<T>(new T);
+                
+                query::rows row = *i;
+                query::rows::getstream getter = row.getter();
+                getter >> out->id__;
+                
+                for(std::vector<sqlite::orm::base_field*>::iterator it = selected.begin(); it != selected.end(); ++it)
+                {
+                    (*it)->read(getter, (char*)out.get());
+                }
+                
+                result.push_back(out);
+            }
+            
+            return result;
+        }
+        
+        // Same but into tuples, e.g. query_columns<boost::tuple<std::string, int> >("name, score")
+        template<typename Tuple>
+        static std::vector<Tuple> query_columns(const std::string& fields, const std::string& where = "",
+            const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>())
+        {
+            std::vector<sqlite::orm::base_field*> selected = fields_of(fields);
+            
+            cached_statement<query> qry(cache(), "proj:" + fields + ":" + where);
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), projection_sql(selected, where));
+            }
+            
+            bind_args(qry, args);
+            
+            std::vector<Tuple> result;
+            for (sqlite3pp::query::iterator i = qry->begin(); i != qry->end(); ++i)
+            {
+                query::rows row = *i;
+                
+                // skip id__
+                query::rows::getstream getter = row.getter(1);
+                result.push_back(Tuple());
+                read_tuple(getter, result.back());
+            }
+            
+            return result;
+        }
+        
+        /*
+         *  Aggregates computed by sqlite. The where clause is optional,
+         *  e.g. count("WHERE highscore > :h", args) or max<int>("highscore").
+         */
+        static long long count(const std::string& where = "",
+            const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>())
+        {
+            return aggregate<long long>("COUNT(*)", where, args);
+        }
+        
+        static bool exists(const std::string& where = "",
+            const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>())
+        {
+            // no row at all reads as false
+            return aggregate<bool>("1", where.empty() ? "LIMIT 1" : where + " LIMIT 1", args);
+        }
+        
+        template<typename V>
+        static V sum(const std::string& field, const std::string& where = "",
+            const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>())
+        {
+            return aggregate<V>("SUM(" + field + ")", where, args);
+        }
         
-        dao(database& db)
+        template<typename V>
+        static V min(const std::string& field, const std::string& where = "",
+            const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>())
         {
-            init(db);
+            return aggregate<V>("MIN(" + field + ")", where, args);
         }
         
         template<typename V>
-        static boost::shared_ptr<T> query_by__fieldname__(std::string fn, V v)
+        static V max(const std::string& field, const std::string& where = "",
+            const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>())
         {
-            std::stringstream ss;
-            
-            ss << "SELECT id__, ";
-            for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                it != T::fields_.end(); ++it)
+            return aggregate<V>("MAX(" + field + ")", where, args);
+        }
+        
+        static double avg(const std::string& field, const std::string& where = "",
+            const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>())
+        {
+            return aggregate<double>("AVG(" + field + ")", where, args);
+        }
+        
+        /*
+         *  Keyset pagination ordered by (field, id__), or by id__ alone.
+         *  Each page seeks past the last row of the previous one, so deep
+         *  pages cost the same as the first. Pass the 'next' token of a
+         *  page to get the following one. NULL sort values come first in
+         *  ascending and last in descending order, as sqlite sorts them.
+         */
+        static page<T> query_page(const std::string& field, std::size_t size, const std::string& token = "", bool descending = false)
+        {
+            const bool by_id = field == "id__";
+            const int col = column_of(field);
+            if(col < 0)
             {
-                ss << (*it)->get_name();
-                if(it+1 != T::fields_.end())
-                {
-                    ss << ", ";
-                }
+                throw std::runtime_error("Unknown field for pagination: " + field);
             }
-            ss << " " << "FROM " << T::table_name()
-            << " WHERE " << fn << " = :var";
             
-#ifdef DEBUG_SQL
-            std::cout << ss.str() << "\n";
-#endif
-
-            query qry(*db_, ss.str().c_str());
-            qry.bind(":var", v);
+            const std::string dir = descending ? " DESC" : "";
+            const std::string cmp = descending ? " < " : " > ";
             
-            for (sqlite3pp::query::iterator i = qry.begin(); i != qry.end(); ++i)
+            // the last row of a page ending on NULL has no value to seek past
+            const bool after_null = !by_id && !token.empty() && token[0] == 'n';
+            
+            cached_statement<query> qry(cache(), "page:" + field + dir + (token.empty() ? "" : after_null ? ":null" : ":next"));
+            if(!qry.prepared())
             {
-                boost::shared_ptr<T> out = boost::shared_ptr<T>(new T);
-                
-                query::rows::getstream getter = (*i).getter();
-                getter >> out->id__;
-                
-                for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                    it != T::fields_.end(); ++it)
+                std::string q = select_sql_;
+                if(by_id && !token.empty())
+                {
+                    q.append(" WHERE id__" + cmp + "?");
+                }
+                else if(after_null)
+                {
+                    // the rest of the NULLs, then (ascending only) all the values
+                    q.append(" WHERE (" + field + " IS NULL AND id__" + cmp + "?)");
+                    q.append(descending ? "" : " OR " + field + " IS NOT NULL");
+                }
+                else if(!token.empty())
                 {
-                    out->values_[(*it)->get_name()] = get_field(getter, it);
+                    // NULLs don't compare, but follow all the values when descending
+                    q.append(" WHERE (" + field + ", id__)" + cmp + "(?, ?)");
+                    q.append(descending ? " OR " + field + " IS NULL" : "");
                 }
+                q.append(" ORDER BY ").append(by_id ? "id__" + dir : field + dir + ", id__" + dir);
+                q.append(" LIMIT ?");
                 
-                // return the first result
-                return out;
+                qry.prepare(db(), q);
             }
             
-            // return empty
-            return boost::shared_ptr<T>();
-        }
-        
-        template<typename V>
-        static std::vector<boost::shared_ptr<T> > query_all_by__fieldname__(std::string fn, V v)
-        {
-            std::stringstream ss;
-            
-            ss << "SELECT id__, ";
-            for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                it != T::fields_.end(); ++it)
+            int idx = 1;
+            if(!token.empty())
             {
-                ss << (*it)->get_name();
-                if(it+1 != T::fields_.end())
+                // token is <type>:<id__>:<value>
+                const std::string::size_type a = token.find(':');
+                const std::string::size_type b = token.find(':', a + 1);
+                if(a != 1 || b == std::string::npos)
+                {
+                    throw std::runtime_error("Malformed page token: " + token);
+                }
+                
+                const sqlite3_int64 last_id = boost::lexical_cast<sqlite3_int64>(token.substr(2, b - 2));
+                const std::string value = token.substr(b + 1);
+                
+                if(!by_id && !after_null)
                 {
-                    ss << ", ";
+                    switch(token[0])
+                    {
+                        case 'i':
+                            qry->bind(idx++, boost::lexical_cast<long long>(value));
+                            break;
+                        case 'f':
+                            qry->bind(idx++, boost::lexical_cast<double>(value));
+                            break;
+                        default:
+                            qry->bind(idx++, value.c_str(), false);
+                            break;
+                    }
                 }
+                qry->bind(idx++, last_id);
             }
-            ss << " " << "FROM " << T::table_name()
-            << " WHERE " << fn << " = :var";
             
-#ifdef DEBUG_SQL
-            std::cout << ss.str() << "\n";
-#endif
+            // one extra row tells whether there is a next page
+            qry->bind(idx, static_cast<long long>(size + 1));
             
-            query qry(*db_, ss.str().c_str());
-            qry.bind(":var", v);
-            
-            std::vector<boost::shared_ptr<T> > result;
+            page<T> result;
+            std::string last;
             
-            for (sqlite3pp::query::iterator i = qry.begin(); i != qry.end(); ++i)
+            for (sqlite3pp::query::iterator i = qry->begin(); i != qry->end(); ++i)
             {
-                boost::shared_ptr<T> out = boost::shared_ptr<T>(new T);
-                
-                query::rows::getstream getter = (*i).getter();
-                getter >> out->id__;
-                
-                for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                    it != T::fields_.end(); ++it)
+                if(result.items.size() == size)
                 {
-                    out->values_[(*it)->get_name()] = get_field(getter, it);
+                    result.next = last;
+                    break;
                 }
                 
-                result.push_back(out);
+                if(result.items.size() + 1 == size)
+                {
+                    last = page_token(row_view(*i), col);
+                }
+                result.items.push_back(hydrate(*i));
             }
             
             return result;
         }
         
-        boost::shared_ptr<T> query_first()
+        // Column index of a field in the rows passed to visit()
+        static int column_of(const std::string& name)
         {
-            std::string q = "SELECT id__, ";
-            for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                it != T::fields_.end(); ++it)
+            for(std::size_t i = 0; i < T::fields_.size(); ++i)
             {
-                q.append((*it)->get_name());
-                if(it+1 != T::fields_.end())
+                if(T::fields_[i]->get_name() == name)
                 {
-                    q.append(", ");
+                    return static_cast<int>(i) + 1;
                 }
             }
-            q.append(" ").append("FROM ").append(T::table_name()).append(" LIMIT 1");
+            return name == "id__" ? 0 : -1;
+        }
+        
+        // Calls f(const row_view&) for every row; nothing is hydrated or copied
+        template<typename F>
+        std::size_t visit(F f)
+        {
+            cached_statement<query> qry(cache(), "all");
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), select_sql_);
+            }
+            
+            return visit_rows(*qry, f);
+        }
+        
+        template<typename F>
+        std::size_t visit(const std::string& where, const std::map<std::string, boost::any>& args, F f)
+        {
+            cached_statement<query> qry(cache(), "all:" + where);
+            if(!qry.prepared())
+            {
+                qry.prepare(db(), select_sql_ + " " + where);
+            }
+            
+            // bind all arguments
+            bind_args(qry, args);
+            
+            return visit_rows(*qry, f);
+        }
+        
+        // Calls f(T&) for every row, reusing one object
+        template<typename F>
+        std::size_t for_each(F f)
+        {
+            return cursor_all(true).for_each(f);
+        }
+
+        static void remove(boost::shared_ptr<T>& obj)
+        {
+            remove(*(obj.get()));
+        }
+
+        static void remove(T& obj)
+        {
+            write_scope ws(*db_);
+            
+            // the cascade and the row itself go away together or not at all
+            unit_of_work work(db(), atomic_ && !T::foreign_.empty());
+            
+            // remove all cascade
+            for(std::vector<base_foreign_collection*>::iterator it = T::foreign_.begin(); it != T::foreign_.end(); ++it)
+            {
+                char* base = (char*)&obj;
+                sqlite::orm::base_foreign_collection * ptr = reinterpret_cast<sqlite::orm::base_foreign_collection*> ( base+(*it)->offset );
+                ptr->remove(obj);
+            }
+            
+            cached_statement<command> cmd(cache(), "remove");
+            if(!cmd.prepared())
+            {
+                cmd.prepare(db(), "DELETE FROM " + T::table_name() + " WHERE id__ = :var");
+            }
+            
+            cmd->bind(1, obj.id__);
 
 #ifdef DEBUG_SQL
-            std::cout << q << "\n";
+            std::cout << ":var == " << wrap_type(obj.id__) << "\n";
 #endif
-            query qry(*db_, q.c_str());
+            if(cmd->execute() != SQLITE_OK)
+            {
+                throw database_error(db());
+            }
             
-            for (sqlite3pp::query::iterator i = qry.begin(); i != qry.end(); ++i)
+            if(session::current())
             {
-                boost::shared_ptr<T> out = boost::shared_ptr<T>(new T);
-
-                query::rows::getstream getter = (*i).getter();
-                getter >> out.id__;
-                
-                for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                    it != T::fields_.end(); ++it)
-                {
-                    out->values_[(*it)->get_name()] = get_field(getter, it);
-                }
-
-                return out;
+                session::current()->evict<T>(obj.id__);
             }
             
-            return boost::shared_ptr<T>(NULL);
+            mark_removed(obj);
+            
+            work.commit();
+            ws.commit();
         }
         
-        boost::shared_ptr<T> query_first(const std::string& where, const std::map<std::string, boost::any>& args)
+        // The row is gone; saving the object again writes all of it, and
+        // the same goes for the children loaded into its collections
+        static void mark_removed(T& obj)
         {
-            std::string q = "SELECT id__, ";
-            for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                it != T::fields_.end(); ++it)
+            unit_of_work::track(db(), obj);
+            obj.mark_dirty();
+            
+            for(std::vector<base_foreign_collection*>::iterator it = T::foreign_.begin(); it != T::foreign_.end(); ++it)
             {
-                q.append((*it)->get_name());
-                if(it+1 != T::fields_.end())
-                {
-                    q.append(", ");
-                }
+                char* base = (char*)&obj;
+                sqlite::orm::base_foreign_collection * ptr = reinterpret_cast<sqlite::orm::base_foreign_collection*> ( base+(*it)->offset );
+                ptr->mark_removed(obj);
+            }
+        }
+        
+        /*
+         *  Set-based delete of all rows matching 'cond' (which may refer to
+         *  :owner__) along with everything they own, one DELETE per table.
+         *  Used by HAS_MANY to cascade without loading the children.
+         */
+        static void remove_owned(const std::string& cond, sqlite3_int64 owner)
+        {
+            const std::string owned = "SELECT id__ FROM " + T::table_name() + " WHERE " + cond;
+            for(std::vector<base_foreign_collection*>::iterator it = T::foreign_.begin(); it != T::foreign_.end(); ++it)
+            {
+                (*it)->remove_owned(owned, owner);
             }
-            q.append(" ").append("FROM ").append(T::table_name()).append(" ")
-                .append(where).append(" LIMIT 1");
             
-#ifdef DEBUG_SQL
-            std::cout << q << "\n";
-#endif
-            query qry(*db_, q.c_str());
-
-            // bind all arguments
-            for(std::map<std::string, boost::any>::const_iterator it = args.begin(); it != args.end(); ++it)
+            // the session can't learn about these rows from the delete itself
+            if(session::current())
             {
-                if(it->second.type() == typeid(long))
-                {
-                    qry.bind(it->first.c_str(), static_cast<long long>(boost::any_cast<long>(it->second)));
-                }
-                else if(it->second.type() == typeid(int))
-                {
-                    qry.bind(it->first.c_str(), boost::any_cast<int>(it->second));
-                }
-                else if(it->second.type() == typeid(sqlite3_int64))
-                {
-                    qry.bind(it->first.c_str(), boost::any_cast<sqlite3_int64>(it->second));
-                }
-                else if(it->second.type() == typeid(double))
-                {
-                    qry.bind(it->first.c_str(), boost::any_cast<double>(it->second));
-                }
-                else if(it->second.type() == typeid(std::string))
+                cached_statement<query> qry(cache(), "owned:" + cond);
+                if(!qry.prepared())
                 {
-                    qry.bind(it->first.c_str(), boost::any_cast<std::string>(it->second));
+                    qry.prepare(db(), owned);
                 }
-                else if(it->second.type() == typeid(sql_date))
-                {
-                    qry.bind(it->first.c_str(), wrap_type(boost::any_cast<sql_date>(it->second)));
-                }
-                else
+                
+                bind_value(*qry, 1, owner);
+                for (sqlite3pp::query::iterator i = qry->begin(); i != qry->end(); ++i)
                 {
-                    // Should not happen.
-                    throw std::runtime_error(std::string("Trying to bind field of unknown type: ") + it->second.type().name());
+                    session::current()->evict<T>((*i).get<sqlite3_int64>(0));
                 }
             }
             
-            for (sqlite3pp::query::iterator i = qry.begin(); i != qry.end(); ++i)
+            cached_statement<command> cmd(cache(), "remove:" + cond);
+            if(!cmd.prepared())
             {
-                boost::shared_ptr<T> out = boost::shared_ptr<T>(new T);
-                
-                query::rows::getstream getter = (*i).getter();
-                getter >> out->id__;
-                
-                for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                    it != T::fields_.end(); ++it)
-                {
-                    out->values_[(*it)->get_name()] = get_field(getter, it);
-                }
-                
-                return out;
+                cmd.prepare(db(), "DELETE FROM " + T::table_name() + " WHERE " + cond);
             }
             
-            return boost::shared_ptr<T>();
+#ifdef DEBUG_SQL
+            std::cout << ":owner__ == " << wrap_type(owner) << "\n";
+#endif
+            bind_value(*cmd, 1, owner);
+            if(cmd->execute() != SQLITE_OK)
+            {
+                throw database_error(db());
+            }
         }
         
-        std::vector<boost::shared_ptr<T> > query_all()
+        static void save(T& obj)
         {
-            std::string q = "SELECT id__, ";
-            for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                it != T::fields_.end(); ++it)
+            write_scope ws(*db_);
+            unit_of_work work(db(), atomic_ && !T::foreign_.empty());
+            save_row(obj);
+            save_foreign(obj);
+            work.commit();
+            ws.commit();
+        }
+        
+        // Whether save/remove of an object with foreign collections runs as
+        // one unit of work (the default) or statement by statement.
+        static void set_atomic(bool atomic)
+        {
+            atomic_ = atomic;
+        }
+        
+        // Saves all objects in one transaction. With 'multirow' new objects
+        // are inserted by chunks of multi-row INSERT statements.
+        template<typename Iterator>
+        static void save_all(Iterator begin, Iterator end, bool multirow = false)
+        {
+            write_scope ws(*db_);
+            unit_of_work work(db());
+            
+            // a model without fields has nothing to put into VALUES
+            multirow = multirow && !T::fields_.empty();
+            const std::size_t chunk = multirow ? std::max<std::size_t>(1, SQLITE_MAX_VARIABLE_NUMBER / T::fields_.size()) : 0;
+            std::vector<T*> pending;
+            
+            for(Iterator it = begin; it != end; ++it)
             {
-                q.append((*it)->get_name());
-                if(it+1 != T::fields_.end())
+                T& obj = object_of(*it);
+                
+                if(multirow && obj.id__ == -1)
+                {
+                    pending.push_back(&obj);
+                    if(pending.size() == chunk)
+                    {
+                        insert_rows(pending);
+                        pending.clear();
+                    }
+                }
+                else
                 {
-                    q.append(", ");
+                    save_row(obj);
                 }
             }
-            q.append(" ").append("FROM ").append(T::table_name());
             
-#ifdef DEBUG_SQL
-            std::cout << q << "\n";
-#endif
-            query qry(*db_, q.c_str());
+            // one more INSERT sized to what is left over
+            if(pending.size() > 1)
+            {
+                insert_rows(pending);
+            }
+            else if(!pending.empty())
+            {
+                save_row(*pending.front());
+            }
             
-            std::vector<boost::shared_ptr<T> > result;
+            for(Iterator it = begin; it != end; ++it)
+            {
+                save_foreign(object_of(*it));
+            }
             
-            for (sqlite3pp::query::iterator i = qry.begin(); i != qry.end(); ++i)
+            work.commit();
+            ws.commit();
+        }
+        
+        template<typename Range>
+        static void save_all(Range& objects, bool multirow = false)
+        {
+            save_all(objects.begin(), objects.end(), multirow);
+        }
+        
+        /*
+         *  Asynchronous variants running on a worker_pool. Saves and removes
+         *  of the same object run in the order they were requested; the
+         *  object must not be modified until its future is ready.
+         */
+        static boost::shared_future<void> save_async(worker_pool& workers, const boost::shared_ptr<T>& obj)
+        {
+            return workers.submit<void>(obj.get(), boost::bind(&dao<T>::save_shared, obj));
+        }
+        
+        static void save_async(worker_pool& workers, const boost::shared_ptr<T>& obj,
+            const boost::function<void (boost::shared_future<void>)>& done)
+        {
+            workers.submit<void>(obj.get(), boost::bind(&dao<T>::save_shared, obj), done);
+        }
+        
+        static boost::shared_future<void> remove_async(worker_pool& workers, const boost::shared_ptr<T>& obj)
+        {
+            return workers.submit<void>(obj.get(), boost::bind(&dao<T>::remove_shared, obj));
+        }
+        
+        static void remove_async(worker_pool& workers, const boost::shared_ptr<T>& obj,
+            const boost::function<void (boost::shared_future<void>)>& done)
+        {
+            workers.submit<void>(obj.get(), boost::bind(&dao<T>::remove_shared, obj), done);
+        }
+        
+        static boost::shared_future<boost::shared_ptr<T> > query_first_async(worker_pool& workers, const std::string& where,
+            const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>())
+        {
+            return workers.submit<boost::shared_ptr<T> >(NULL, boost::bind(&dao<T>::first_where, where, args));
+        }
+        
+        static boost::shared_future<std::vector<boost::shared_ptr<T> > > query_all_async(worker_pool& workers, const std::string& where,
+            const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>())
+        {
+            return workers.submit<std::vector<boost::shared_ptr<T> > >(NULL, boost::bind(&dao<T>::all_where, where, args));
+        }
+        
+        static void query_all_async(worker_pool& workers, const std::string& where, const std::map<std::string, boost::any>& args,
+            const boost::function<void (boost::shared_future<std::vector<boost::shared_ptr<T> > >)>& done)
+        {
+            workers.submit<std::vector<boost::shared_ptr<T> > >(NULL, boost::bind(&dao<T>::all_where, where, args), done);
+        }
+        
+        template<typename E>
+        static boost::shared_future<std::vector<boost::shared_ptr<T> > > query_all_async(worker_pool& workers, const expr<E>& cond)
+        {
+            return workers.submit<std::vector<boost::shared_ptr<T> > >(NULL, boost::bind(&dao<T>::template all_matching<E>, cond.self()));
+        }
+        
+        /*
+         *  Group commit: the object is saved (or removed) by the write_behind
+         *  thread in the next batch. The ticket is ready once that batch is
+         *  committed; waiting for it is optional.
+         */
+        static boost::shared_future<void> save_behind(write_behind& writer, const boost::shared_ptr<T>& obj)
+        {
+            return writer.enqueue(boost::bind(&dao<T>::save_shared, obj));
+        }
+        
+        static boost::shared_future<void> remove_behind(write_behind& writer, const boost::shared_ptr<T>& obj)
+        {
+            return writer.enqueue(boost::bind(&dao<T>::remove_shared, obj));
+        }
+        
+    private:
+        // Non-overloaded entry points for boost::bind
+        static void save_shared(boost::shared_ptr<T> obj)
+        {
+            save(*obj);
+        }
+        
+        static void remove_shared(boost::shared_ptr<T> obj)
+        {
+            remove(*obj);
+        }
+        
+        static boost::shared_ptr<T> first_where(const std::string& where, const std::map<std::string, boost::any>& args)
+        {
+            return query_first(where, args);
+        }
+        
+        static std::vector<boost::shared_ptr<T> > all_where(const std::string& where, const std::map<std::string, boost::any>& args)
+        {
+            return query_all(where, args);
+        }
+        
+        template<typename E>
+        static std::vector<boost::shared_ptr<T> > all_matching(const E& cond)
+        {
+            return query_all(cond);
+        }
+        
+        static T& object_of(T& obj)
+        {
+            return obj;
+        }
+        
+        static T& object_of(const boost::shared_ptr<T>& obj)
+        {
+            return *obj;
+        }
+        
+        // Multi-row INSERT of new objects. RETURNING hands back the new ids in
+        // no particular order; rows get increasing ids in VALUES order, so
+        // the sorted ids are assigned to the objects in turn.
+        static void insert_rows(const std::vector<T*>& objs)
+        {
+            cached_statement<query> cmd(cache(), "insert:" + boost::lexical_cast<std::string>(objs.size()));
+            if(!cmd.prepared())
             {
-                boost::shared_ptr<T> out = boost::shared_ptr<T>(new T);
+                std::string row = "(";
+                std::string q = "INSERT INTO ";
+                q.append(T::table_name()).append(" (");
+                
+                for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
+                    it != T::fields_.end(); ++it)
+                {
+                    q.append((*it)->get_name());
+                    row.append("?");
+                    if(it+1 != T::fields_.end())
+                    {
+                        q.append(", ");
+                        row.append(", ");
+                    }
+                }
                 
-                query::rows::getstream getter = (*i).getter();
-                getter >> out->id__;
+                q.append(") VALUES ");
+                row.append(")");
                 
-                for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                    it != T::fields_.end(); ++it)
+                for(std::size_t i = 0; i < objs.size(); ++i)
                 {
-                    out->values_[(*it)->get_name()] = get_field(getter, it);
+                    q.append(i ? ", " : "").append(row);
                 }
+                q.append(" RETURNING id__");
                 
-                result.push_back(out);
+                cmd.prepare(db(), q);
             }
             
-            return result;
-        }
-
-        std::vector<boost::shared_ptr<T> > query_all(const std::string& where, const std::map<std::string, boost::any>& args)
-        {
-            std::string q = "SELECT id__, ";
-            for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                it != T::fields_.end(); ++it)
+            int idx = 1;
+            for(typename std::vector<T*>::const_iterator o = objs.begin(); o != objs.end(); ++o)
             {
-                q.append((*it)->get_name());
-                if(it+1 != T::fields_.end())
+                for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
+                    it != T::fields_.end(); ++it)
                 {
-                    q.append(", ");
+                    (*it)->bind(*cmd, idx++, (char*)*o);
                 }
             }
-            q.append(" ").append("FROM ").append(T::table_name());
-            
-#ifdef DEBUG_SQL
-            std::cout << q << "\n";
-#endif
-            query qry(*db_, q.c_str());
             
-            // bind all arguments
-            for(std::map<std::string, boost::any>::const_iterator it = args.begin(); it != args.end(); ++it)
+            std::vector<sqlite3_int64> ids;
+            ids.reserve(objs.size());
+            for (sqlite3pp::query::iterator i = cmd->begin(); i != cmd->end(); ++i)
             {
-                if(it->second.type() == typeid(long))
-                {
-                    qry.bind(it->first.c_str(), static_cast<long long>(boost::any_cast<long>(it->second)));
-                }
-                else if(it->second.type() == typeid(int))
-                {
-                    qry.bind(it->first.c_str(), boost::any_cast<int>(it->second));
-                }
-                else if(it->second.type() == typeid(sqlite3_int64))
-                {
-                    qry.bind(it->first.c_str(), boost::any_cast<sqlite3_int64>(it->second));
-                }
-                else if(it->second.type() == typeid(double))
-                {
-                    qry.bind(it->first.c_str(), boost::any_cast<double>(it->second));
-                }
-                else if(it->second.type() == typeid(std::string))
-                {
-                    qry.bind(it->first.c_str(), boost::any_cast<std::string>(it->second));
-                }
-                else if(it->second.type() == typeid(sql_date))
-                {
-                    qry.bind(it->first.c_str(), wrap_type(boost::any_cast<sql_date>(it->second)));
-                }
-                else
-                {
-                    // Should not happen.
-                    throw std::runtime_error(std::string("Trying to bind field of unknown type: ") + it->second.type().name());
-                }
+                ids.push_back((*i).get<sqlite3_int64>(0));
             }
+            std::sort(ids.begin(), ids.end());
             
-            std::vector<boost::shared_ptr<T> > result;
-            
-            for (sqlite3pp::query::iterator i = qry.begin(); i != qry.end(); ++i)
+            std::vector<sqlite3_int64>::const_iterator id = ids.begin();
+            for(typename std::vector<T*>::const_iterator o = objs.begin(); o != objs.end(); ++o, ++id)
             {
-                boost::shared_ptr<T> out = boost::shared_ptr<T>(new T);
-                
-                query::rows::getstream getter = (*i).getter();
-                getter >> out->id__;
-                
-                for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                    it != T::fields_.end(); ++it)
-                {
-                    out->values_[(*it)->get_name()] = get_field(getter, it);
-                }
-                
-                result.push_back(out);
+                unit_of_work::track(db(), **o);
+                (*o)->id__ = *id;
+                (*o)->mark_clean();
             }
-            
-            return result;
-        }
-
-        static void remove(boost::shared_ptr<T>& obj)
-        {
-            remove(*(obj.get()));
         }
-
-        static void remove(T& obj)
+        
+        static void save_foreign(T& obj)
         {
-            // remove all cascade
+            // now when we have the id__ lets save the foreign collections if we have any
             for(std::vector<base_foreign_collection*>::iterator it = T::foreign_.begin(); it != T::foreign_.end(); ++it)
             {
                 char* base = (char*)&obj;
                 sqlite::orm::base_foreign_collection * ptr = reinterpret_cast<sqlite::orm::base_foreign_collection*> ( base+(*it)->offset );
-                ptr->remove(obj);
+                ptr->save(obj);
             }
-            
-            std::string q = "DELETE FROM ";
-            q.append(T::table_name());
-            q.append(" WHERE id__ = :var");
-            
-#ifdef DEBUG_SQL
-            std::cout << q << "\n";
-#endif
-            command cmd(*db_, q.c_str());
-            cmd.bind(":var", obj.id__);
-
-#ifdef DEBUG_SQL
-            std::cout << ":var == " << wrap_type(obj.id__) << "\n";
-#endif
-            cmd.execute();
         }
         
-        static void save(T& obj)
+        // UPDATE of the dirty columns only. Returns false if there was
+        // no row with this id__ to update.
+        static bool update_row(T& obj)
         {
-            std::string q = "INSERT OR REPLACE INTO ";
-            q.append(T::table_name());
-            q.append(" (id__, ");
+            std::string key = "update:";
+            std::vector<sqlite::orm::base_field*> dirty;
             
             for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
                 it != T::fields_.end(); ++it)
             {
-                q.append((*it)->get_name());
-                if(it+1 != T::fields_.end())
+                bool d = obj.is_dirty((*it)->index);
+                key.append(1, d ? '1' : '0');
+                if(d)
                 {
-                    q.append(", ");
+                    dirty.push_back(*it);
                 }
             }
             
-            q.append(") VALUES (");
-            if(obj.id__ == -1) {
-                q.append("NULL, ");
+            cached_statement<command> cmd(cache(), key);
+            if(!cmd.prepared())
+            {
+                std::string q = "UPDATE " + T::table_name() + " SET ";
+                for(std::vector<sqlite::orm::base_field*>::iterator it = dirty.begin(); it != dirty.end(); ++it)
+                {
+                    q.append(it == dirty.begin() ? "" : ", ").append((*it)->get_name()).append(" = ?");
+                }
+                q.append(" WHERE id__ = ?");
+                
+                cmd.prepare(db(), q);
             }
-            else
+            
+            char* base = (char*)&obj;
+            int idx = 1;
+            for(std::vector<sqlite::orm::base_field*>::iterator it = dirty.begin(); it != dirty.end(); ++it)
             {
-                q.append(wrap_type(obj.id__)).append(", ");
+                (*it)->bind(*cmd, idx++, base);
             }
+            cmd->bind(idx, obj.id__);
             
-            for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                it != T::fields_.end(); ++it)
+            if(cmd->execute() != SQLITE_OK)
             {
-                q.append(":" + (*it)->get_name());
-                
-                if(it+1 != T::fields_.end())
+                throw database_error(db());
+            }
+            
+            return db().changes() > 0;
+        }
+        
+        static void save_row(T& obj)
+        {
+            if(obj.id__ != -1)
+            {
+                // nothing changed since it was loaded or saved
+                if(!obj.is_dirty())
                 {
-                    q.append(", ");
+                    return;
                 }
             }
             
-            q.append(")");
-
-#ifdef DEBUG_SQL
-            std::cout << q << "\n";
-#endif
-            command cmd(*db_, q.c_str());
+            unit_of_work::track(db(), obj);
             
-            for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                it != T::fields_.end(); ++it)
+            if(obj.id__ != -1)
             {
-                boost::any val = obj.values_[(*it)->get_name()];
-                
-                if(val.type() == typeid(long))
-                {
-                    cmd.bind((":" + (*it)->get_name()).c_str(), static_cast<sqlite3_int64>(boost::any_cast<long>(val)));
-                }
-                else if(val.type() == typeid(sqlite3_int64))
-                {
-                    cmd.bind((":" + (*it)->get_name()).c_str(), boost::any_cast<sqlite3_int64>(val));
-                }
-                else if(val.type() == typeid(double))
-                {
-                    cmd.bind((":" + (*it)->get_name()).c_str(), boost::any_cast<double>(val));
-                }
-                else if(val.type() == typeid(std::string))
-                {
-                    cmd.bind((":" + (*it)->get_name()).c_str(), boost::any_cast<std::string>(val).c_str());
-                }
-                else if(val.type() == typeid(sql_date))
-                {
-                    cmd.bind((":" + (*it)->get_name()).c_str(), wrap_type(boost::any_cast<sql_date>(val)));
-                }
-                else if(val.type() == typeid(bool))
-                {
-                    cmd.bind((":" + (*it)->get_name()).c_str(), boost::any_cast<bool>(val));
-                }
-                else
+                if(update_row(obj))
                 {
-                    cmd.bind((":" + (*it)->get_name()).c_str(), boost::any_cast<int>(val));
+                    obj.mark_clean();
+                    return;
                 }
             }
             
-            cmd.execute();
+            cached_statement<query> cmd(cache(), "save");
+            if(!cmd.prepared())
+            {
+                cmd.prepare(db(), save_sql_);
+            }
             
-            // Set new id
+            // NULL makes sqlite assign a new id
             if(obj.id__ == -1) {
-                obj.id__ = db_->last_insert_rowid();
+                cmd->bind(1);
+            }
+            else
+            {
+                cmd->bind(1, obj.id__);
             }
             
-            // now when we have the id__ lets save the foreign collections if we have any
-            for(std::vector<base_foreign_collection*>::iterator it = T::foreign_.begin(); it != T::foreign_.end(); ++it)
+            char* base = (char*)&obj;
+            for(std::size_t i = 0; i < T::fields_.size(); ++i)
             {
-                char* base = (char*)&obj;
-                sqlite::orm::base_foreign_collection * ptr = reinterpret_cast<sqlite::orm::base_foreign_collection*> ( base+(*it)->offset );
-                ptr->save(obj);
+                T::fields_[i]->bind(*cmd, save_params_[i], base);
             }
+            
+            // new objects get their id straight from RETURNING
+            sqlite3pp::query::iterator i = cmd->begin();
+            if(i != cmd->end())
+            {
+                obj.id__ = (*i).get<sqlite3_int64>(0);
+            }
+            
+            obj.mark_clean();
         }
     };
     
@@ -633,6 +3183,135 @@ namespace orm {
     template<typename T>
     database* dao<T>::db_;
     
+    template<typename T>
+    bool dao<T>::atomic_ = true;
+    
+    template<typename T>
+    statement_cache dao<T>::cache_;
+    
+    template<typename T>
+    object_cache<T> dao<T>::objects_;
+    
+    template<typename T>
+    std::string dao<T>::select_sql_;
+    
+    template<typename T>
+    std::string dao<T>::save_sql_;
+    
+    template<typename T>
+    std::vector<int> dao<T>::save_params_;
+    
+    /*
+     *  CURSOR
+     *  Lazy result of a dao query. Keeps its statement until the end of
+     *  the results is reached or close() is called. Copies share the
+     *  position: advancing one advances them all.
+     */
+    template<typename T>
+    class cursor
+    {
+    public:
+        typedef boost::shared_ptr<cached_statement<query> > statement_ptr;
+        
+        cursor(statement_ptr qry, bool reuse)
+        : state_(new state(qry, reuse))
+        {
+        }
+        
+        // Steps to the next row; returns false at the end
+        bool next()
+        {
+            state& s = *state_;
+            if(!s.qry)
+            {
+                return false;
+            }
+            
+            if(!s.started)
+            {
+                s.it = (*s.qry)->begin();
+                s.started = true;
+            }
+            else
+            {
+                ++s.it;
+            }
+            
+            if(s.it == (*s.qry)->end())
+            {
+                close();
+                return false;
+            }
+            
+            if(!s.current || !s.reuse)
+            {
+                s.current = boost::shared_ptr<T>(new T);
+            }
+            
+            dao<T>::hydrate(*s.it, *s.current);
+            return true;
+        }
+        
+        const boost::shared_ptr<T>& get() const
+        {
+            return state_->current;
+        }
+        
+        // Stops early and gives the statement back to the dao
+        void close()
+        {
+            state_->qry.reset();
+        }
+        
+        template<typename F>
+        std::size_t for_each(F f)
+        {
+            std::size_t cnt = 0;
+            while(next())
+            {
+                f(*get());
+                ++cnt;
+            }
+            return cnt;
+        }
+        
+        // Same as for_each but stops as soon as f returns false
+        template<typename F>
+        std::size_t for_each_while(F f)
+        {
+            std::size_t cnt = 0;
+            while(next())
+            {
+                ++cnt;
+                if(!f(*get()))
+                {
+                    close();
+                    break;
+                }
+            }
+            return cnt;
+        }
+    
+    private:
+        struct state
+        {
+            state(statement_ptr q, bool r)
+            : qry(q)
+            , reuse(r)
+            , started(false)
+            {
+            }
+            
+            statement_ptr qry;
+            query::iterator it;
+            boost::shared_ptr<T> current;
+            bool reuse;
+            bool started;
+        };
+        
+        boost::shared_ptr<state> state_;
+    };
+    
     struct base_model
     {
     };
@@ -643,16 +3322,11 @@ namespace orm {
     {
     public:
         friend class sqlite::orm::dao<T>;
+        friend class sqlite::orm::unit_of_work;
         
         model()
         : id__(-1)
         {
-            for(std::vector<sqlite::orm::base_field*>::iterator it = T::fields_.begin();
-                it != T::fields_.end(); ++it)
-            {
-                // init with default value
-                values_[(*it)->get_name()] = (*it)->def;
-            }        
         }
         
         static const std::string table_name()
@@ -660,8 +3334,20 @@ namespace orm {
             return typeid(T).name();
         }
         
+        // Hidden by models which declare indexes
+        static void indexes(sqlite::orm::index_set&)
+        {
+        }
+        
         static void add_field(sqlite::orm::base_field* f, int offset)
         {
+            if(fields_.size() == SQLITE_ORM_MAX_FIELDS)
+            {
+                throw std::runtime_error("Too many fields in model. Define SQLITE_ORM_MAX_FIELDS to raise the limit");
+            }
+            
+            f->offset = offset;
+            f->index = static_cast<int>(fields_.size());
             fields_.push_back(f);
         }
 
@@ -689,9 +3375,40 @@ namespace orm {
             return id__;
         }
         
+        static sqlite::orm::column<sqlite::orm::id_field> col_id()
+        {
+            return sqlite::orm::column<sqlite::orm::id_field>();
+        }
+        
+        // Fields changed through setters since the last load or save
+        bool is_dirty() const
+        {
+            return dirty_.any();
+        }
+        
+        bool is_dirty(int field) const
+        {
+            return dirty_.test(field);
+        }
+        
+        void mark_dirty(int field)
+        {
+            dirty_.set(field);
+        }
+        
+        void mark_dirty()
+        {
+            dirty_.set();
+        }
+        
+        void mark_clean()
+        {
+            dirty_.reset();
+        }
+        
     protected:
         sqlite3_int64 id__;
-        std::map<std::string, boost::any> values_;
+        std::bitset<SQLITE_ORM_MAX_FIELDS> dirty_;
     };
     
     template<typename T>
@@ -705,36 +3422,36 @@ namespace orm {
 /*
  *  COMMON PART
  */
-#define STD_FIELD_BODY(name, type)\
-: public sqlite::orm::base_field \
+#define STD_FIELD_BODY(name, type, value_type) STD_FIELD_BODY_EX(name, type, value_type, false)
+
+#define STD_FIELD_BODY_EX(name, type, value_type, indexed)\
 {\
+typedef value_type data_type;\
+static sqlite::orm::field<value_type>& descriptor()\
+{\
+static sqlite::orm::field<value_type> f(#name, type, indexed);\
+return f;\
+}\
 void init()\
 {\
 static bool _init = false; \
 if(!_init)\
 {\
-sqlite::orm::model<MODEL_NAME>::add_field(this, offsetof(MODEL_NAME, name));\
+sqlite::orm::model<MODEL_NAME>::add_field(&descriptor(), offsetof(MODEL_NAME, name));\
 _init = true; \
 }\
 }\
 \
-virtual const std::string get_name()\
-{\
-return #name;\
-}\
-virtual const std::string get_type()\
-{\
-return type;\
-}\
+value_type value;\
 
 /*
  *  TEXT
  */
 #define FIELD_STR(name) \
 struct field_##name \
-STD_FIELD_BODY(name, "TEXT") \
+STD_FIELD_BODY(name, "TEXT", std::string) \
 field_##name(const std::string& def)\
-: sqlite::orm::base_field(def)\
+: value(def)\
 {\
 init(); \
 }\
@@ -742,6 +3459,7 @@ init(); \
 private:\
 field_##name name;\
 public:\
+static sqlite::orm::column<field_##name> col_##name() { return sqlite::orm::column<field_##name>(); } \
 boost::shared_ptr<MODEL_NAME> query_by_##name(const std::string& v) \
 {\
 return sqlite::orm::dao<MODEL_NAME>::query_by__fieldname__(#name, v);\
@@ -750,17 +3468,17 @@ std::vector<boost::shared_ptr<MODEL_NAME> > query_all_by_##name(const std::strin
 {\
 return sqlite::orm::dao<MODEL_NAME>::query_all_by__fieldname__(#name, v);\
 }\
-const std::string get_##name() const { return boost::any_cast<std::string>(values_.at(#name)); } \
-void set_##name(const std::string& s) { values_[#name] = s; }
+const std::string get_##name() const { return name.value; } \
+void set_##name(const std::string& v) { name.value = v; mark_dirty(field_##name::descriptor().index); }
 
 /*
  *  DATE
  */
 #define FIELD_DATE(name) \
 struct field_##name \
-STD_FIELD_BODY(name, "DATE") \
+STD_FIELD_BODY(name, "DATE", sqlite::orm::sql_date) \
 field_##name(const sqlite::orm::sql_date& def)\
-: sqlite::orm::base_field(def)\
+: value(def)\
 {\
 init(); \
 }\
@@ -768,6 +3486,7 @@ init(); \
 private:\
 field_##name name;\
 public:\
+static sqlite::orm::column<field_##name> col_##name() { return sqlite::orm::column<field_##name>(); } \
 boost::shared_ptr<MODEL_NAME> query_by_##name(const sqlite::orm::sql_date& v) \
 {\
 return sqlite::orm::dao<MODEL_NAME>::query_by__fieldname__(#name, v);\
@@ -776,17 +3495,17 @@ std::vector<boost::shared_ptr<MODEL_NAME> > query_all_by_##name(const sqlite::or
 {\
 return sqlite::orm::dao<MODEL_NAME>::query_all_by__fieldname__(#name, v);\
 }\
-const sqlite::orm::sql_date get_##name() const { return boost::any_cast<sqlite::orm::sql_date>(values_.at(#name)); } \
-void set_##name(const sqlite::orm::sql_date& d) { values_[#name] = d; }
+const sqlite::orm::sql_date get_##name() const { return name.value; } \
+void set_##name(const sqlite::orm::sql_date& v) { name.value = v; mark_dirty(field_##name::descriptor().index); }
     
 /*
  *  NUMBER
  */
 #define FIELD_NUM(name) \
 struct field_##name \
-STD_FIELD_BODY(name, "NUM")\
+STD_FIELD_BODY(name, "NUM", long)\
 field_##name(long def)\
-: sqlite::orm::base_field((long)def)\
+: value(def)\
 {\
 init(); \
 }\
@@ -794,6 +3513,7 @@ init(); \
 private:\
 field_##name name;\
 public:\
+static sqlite::orm::column<field_##name> col_##name() { return sqlite::orm::column<field_##name>(); } \
 boost::shared_ptr<MODEL_NAME> query_by_##name(long v) \
 {\
 return sqlite::orm::dao<MODEL_NAME>::query_by__fieldname__(#name, v);\
@@ -802,17 +3522,17 @@ std::vector<boost::shared_ptr<MODEL_NAME> > query_all_by_##name(long v) \
 {\
 return sqlite::orm::dao<MODEL_NAME>::query_all_by__fieldname__(#name, v);\
 }\
-const long get_##name() const { return boost::any_cast<long>(values_.at(#name)); } \
-void set_##name(const long& l) { values_[#name] = l; }
+const long get_##name() const { return name.value; } \
+void set_##name(const long& v) { name.value = v; mark_dirty(field_##name::descriptor().index); }
 
 /*
  *  INTEGER
  */
 #define FIELD_INT(name) \
 struct field_##name \
-STD_FIELD_BODY(name, "INTEGER")\
+STD_FIELD_BODY(name, "INTEGER", int)\
 field_##name(int def)\
-: sqlite::orm::base_field((int)def)\
+: value(def)\
 {\
 init(); \
 }\
@@ -820,6 +3540,7 @@ init(); \
 private:\
 field_##name name;\
 public:\
+static sqlite::orm::column<field_##name> col_##name() { return sqlite::orm::column<field_##name>(); } \
 boost::shared_ptr<MODEL_NAME> query_by_##name(int v) \
 {\
 return sqlite::orm::dao<MODEL_NAME>::query_by__fieldname__(#name, v);\
@@ -828,17 +3549,17 @@ std::vector<boost::shared_ptr<MODEL_NAME> > query_all_by_##name(int v) \
 {\
 return sqlite::orm::dao<MODEL_NAME>::query_all_by__fieldname__(#name, v);\
 }\
-const int get_##name() const { return boost::any_cast<int>(values_.at(#name)); } \
-void set_##name(const int& i) { values_[#name] = i; }
+const int get_##name() const { return name.value; } \
+void set_##name(const int& v) { name.value = v; mark_dirty(field_##name::descriptor().index); }
 
 /*
  *  INTEGER 64
  */
 #define FIELD_INT64(name) \
 struct field_##name \
-STD_FIELD_BODY(name, "INTEGER")\
+STD_FIELD_BODY(name, "INTEGER", int64_t)\
 field_##name(int64_t def)\
-: sqlite::orm::base_field((int64_t)def)\
+: value(def)\
 {\
 init(); \
 }\
@@ -846,6 +3567,7 @@ init(); \
 private:\
 field_##name name;\
 public:\
+static sqlite::orm::column<field_##name> col_##name() { return sqlite::orm::column<field_##name>(); } \
 boost::shared_ptr<MODEL_NAME> query_by_##name(int64_t v) \
 {\
 return sqlite::orm::dao<MODEL_NAME>::query_by__fieldname__(#name, v);\
@@ -854,8 +3576,8 @@ std::vector<boost::shared_ptr<MODEL_NAME> > query_all_by_##name(int64_t v) \
 {\
 return sqlite::orm::dao<MODEL_NAME>::query_all_by__fieldname__(#name, v);\
 }\
-const int get_##name() const { return boost::any_cast<int64_t>(values_.at(#name)); } \
-void set_##name(const int64_t& i) { values_[#name] = i; }
+const int64_t get_##name() const { return name.value; } \
+void set_##name(const int64_t& v) { name.value = v; mark_dirty(field_##name::descriptor().index); }
 
     
 /*
@@ -863,9 +3585,9 @@ void set_##name(const int64_t& i) { values_[#name] = i; }
  */
 #define FIELD_BOOL(name) \
 struct field_##name \
-STD_FIELD_BODY(name, "INTEGER")\
+STD_FIELD_BODY(name, "INTEGER", bool)\
 field_##name(bool def)\
-: sqlite::orm::base_field((int)(def?1:0))\
+: value(def)\
 {\
 init(); \
 }\
@@ -873,6 +3595,7 @@ init(); \
 private:\
 field_##name name;\
 public:\
+static sqlite::orm::column<field_##name> col_##name() { return sqlite::orm::column<field_##name>(); } \
 boost::shared_ptr<MODEL_NAME> query_by_##name(bool v) \
 {\
 return sqlite::orm::dao<MODEL_NAME>::query_by__fieldname__(#name, v?1:0);\
@@ -881,17 +3604,17 @@ std::vector<boost::shared_ptr<MODEL_NAME> > query_all_by_##name(bool v) \
 {\
 return sqlite::orm::dao<MODEL_NAME>::query_all_by__fieldname__(#name, v);\
 }\
-const bool get_##name() const { return boost::any_cast<bool>(values_.at(#name)); } \
-void set_##name(const bool& b) { values_[#name] = b; }
+const bool get_##name() const { return name.value; } \
+void set_##name(const bool& v) { name.value = v; mark_dirty(field_##name::descriptor().index); }
 
 /*
  *  REAL
  */
 #define FIELD_REAL(name) \
 struct field_##name \
-STD_FIELD_BODY(name, "REAL")\
+STD_FIELD_BODY(name, "REAL", double)\
 field_##name(double def)\
-: sqlite::orm::base_field((double)def)\
+: value(def)\
 {\
 init(); \
 }\
@@ -899,6 +3622,7 @@ init(); \
 private:\
 field_##name name;\
 public:\
+static sqlite::orm::column<field_##name> col_##name() { return sqlite::orm::column<field_##name>(); } \
 boost::shared_ptr<MODEL_NAME> query_by_##name(double v) \
 {\
 return sqlite::orm::dao<MODEL_NAME>::query_by__fieldname__(#name, v);\
@@ -907,8 +3631,8 @@ std::vector<boost::shared_ptr<MODEL_NAME> > query_all_by_##name(double v) \
 {\
 return sqlite::orm::dao<MODEL_NAME>::query_all_by__fieldname__(#name, v);\
 }\
-const double get_##name() const { return boost::any_cast<double>(values_.at(#name)); } \
-void set_##name(const double& d) { values_[#name] = d; }
+const double get_##name() const { return name.value; } \
+void set_##name(const double& v) { name.value = v; mark_dirty(field_##name::descriptor().index); }
 
 /*
  *  HAS MANY IMPL (FOREIGN COLLECTION)
@@ -920,16 +3644,27 @@ void model::save_foreign_##name(model& obj) \
 { \
     for(std::vector<cls>::iterator it = obj.name##_.collection.begin(); it != obj.name##_.collection.end(); ++it) \
     { \
-        it->values_[STR(model##_id)] = obj.id__; \
+        if(it->model##_id.value != obj.id__) \
+        { \
+            it->model##_id.value = obj.id__; \
+            it->mark_dirty(cls::belongs_to_##model::descriptor().index); \
+        } \
         sqlite::orm::dao<cls>::save(*it); \
     } \
 } \
 void model::remove_foreign_##name(model& obj) \
 { \
-    std::vector<boost::shared_ptr<cls> > col = obj.fetch_##name(); \
-    for(std::vector<boost::shared_ptr<cls> >::iterator it = col.begin(); it != col.end(); ++it) \
+    sqlite::orm::dao<cls>::remove_owned(STR(model##_id) " = :owner__", obj.id__); \
+} \
+void model::remove_owned_##name(const std::string& owners, sqlite3_int64 owner) \
+{ \
+    sqlite::orm::dao<cls>::remove_owned(STR(model##_id) " IN (" + owners + ")", owner); \
+} \
+void model::mark_removed_##name(model& obj) \
+{ \
+    for(std::vector<cls>::iterator it = obj.name##_.collection.begin(); it != obj.name##_.collection.end(); ++it) \
     { \
-        sqlite::orm::dao<cls>::remove(*it); \
+        sqlite::orm::dao<cls>::mark_removed(*it); \
     } \
 } \
 std::vector<boost::shared_ptr<cls> > model::fetch_##name() \
@@ -942,6 +3677,55 @@ std::vector<boost::shared_ptr<cls> > model::fetch_##name() \
     }\
     return tmp;\
 } \
+const char* model::name##_key() \
+{ \
+    return STR(model##_id); \
+} \
+long long model::count_##name(const std::string& cond, const std::map<std::string, boost::any>& args) const \
+{ \
+    return sqlite::orm::dao<cls>::count(sqlite::orm::owned_where(name##_key(), cond), sqlite::orm::owned_args(args, id__)); \
+} \
+bool model::exists_##name(const std::string& cond, const std::map<std::string, boost::any>& args) const \
+{ \
+    return sqlite::orm::dao<cls>::exists(sqlite::orm::owned_where(name##_key(), cond), sqlite::orm::owned_args(args, id__)); \
+} \
+double model::avg_##name(const std::string& field, const std::string& cond, const std::map<std::string, boost::any>& args) const \
+{ \
+    return sqlite::orm::dao<cls>::avg(field, sqlite::orm::owned_where(name##_key(), cond), sqlite::orm::owned_args(args, id__)); \
+} \
+void model::prefetch_##name(std::vector<boost::shared_ptr<model> >& parents) \
+{ \
+    std::multimap<sqlite3_int64, model*> owners; \
+    std::vector<sqlite3_int64> ids; \
+    for(std::vector<boost::shared_ptr<model> >::iterator it = parents.begin(); it != parents.end(); ++it) \
+    { \
+        std::pair<std::multimap<sqlite3_int64, model*>::iterator, std::multimap<sqlite3_int64, model*>::iterator> r = \
+            owners.equal_range((*it)->id__); \
+        if(r.first == r.second) \
+        { \
+            ids.push_back((*it)->id__); \
+        } \
+        while(r.first != r.second && r.first->second != it->get()) \
+        { \
+            ++r.first; \
+        } \
+        if(r.first == r.second) \
+        { \
+            (*it)->name##_.collection.clear(); \
+            owners.insert(std::make_pair((*it)->id__, it->get())); \
+        } \
+    } \
+    std::vector<boost::shared_ptr<cls> > tmp = sqlite::orm::dao<cls>::query_all_in__fieldname__(STR(model##_id), ids); \
+    for(std::vector<boost::shared_ptr<cls> >::iterator it = tmp.begin(); it != tmp.end(); ++it) \
+    { \
+        std::pair<std::multimap<sqlite3_int64, model*>::iterator, std::multimap<sqlite3_int64, model*>::iterator> r = \
+            owners.equal_range((*it)->model##_id.value); \
+        for(; r.first != r.second; ++r.first) \
+        { \
+            r.first->second->name##_.collection.push_back(**it); \
+        } \
+    } \
+} \
 void model::add_to_##name(const cls& i) \
 { \
     name##_.collection.push_back(i); \
@@ -966,12 +3750,14 @@ void model::set_##name(const std::vector<cls>& v) { name##_.collection = v; }
  *  HAS MANY (FOREIGN COLLECTION)
  *  Used together with BELONGS_TO to fetch a collection of
  *  foreign objects on demand (lazy).
- */    
+ */
 #define HAS_MANY(cls, name) \
 friend class cls; \
 private: \
     static void save_foreign_##name(MODEL_NAME& obj); \
     static void remove_foreign_##name(MODEL_NAME& obj); \
+    static void remove_owned_##name(const std::string& owners, sqlite3_int64 owner); \
+    static void mark_removed_##name(MODEL_NAME& obj); \
 public: \
 struct foreign_collection_##cls \
 : sqlite::orm::foreign_collection<cls> \
@@ -981,7 +3767,8 @@ struct foreign_collection_##cls \
         static bool _init = false; \
         if(!_init)\
         {\
-            sqlite::orm::model<MODEL_NAME>::add_foreign_collection(this, offsetof(MODEL_NAME, name##_));\
+            static foreign_collection_##cls registered(*this); \
+            sqlite::orm::model<MODEL_NAME>::add_foreign_collection(&registered, offsetof(MODEL_NAME, name##_));\
             _init = true; \
         }\
     }\
@@ -997,11 +3784,48 @@ struct foreign_collection_##cls \
     { \
         MODEL_NAME::remove_foreign_##name(*static_cast<MODEL_NAME*>(&obj)); \
     } \
+    void remove_owned(const std::string& owners, sqlite3_int64 owner) \
+    { \
+        MODEL_NAME::remove_owned_##name(owners, owner); \
+    } \
+    void mark_removed(base_model& obj) \
+    { \
+        MODEL_NAME::mark_removed_##name(*static_cast<MODEL_NAME*>(&obj)); \
+    } \
 }; \
 private: \
     foreign_collection_##cls name##_; \
 public: \
 std::vector<boost::shared_ptr<cls> > fetch_##name(); \
+static void prefetch_##name(std::vector<boost::shared_ptr<MODEL_NAME> >& parents); \
+static const char* name##_key(); \
+long long count_##name(const std::string& cond = "", \
+    const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>()) const; \
+bool exists_##name(const std::string& cond = "", \
+    const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>()) const; \
+double avg_##name(const std::string& field, const std::string& cond = "", \
+    const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>()) const; \
+template<typename V> \
+V sum_##name(const std::string& field, const std::string& cond = "", \
+    const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>()) const \
+{ \
+    return sqlite::orm::dao<typename sqlite::orm::late<cls, V>::type>::template sum<V>(field, \
+        sqlite::orm::owned_where(name##_key(), cond), sqlite::orm::owned_args(args, id__)); \
+} \
+template<typename V> \
+V min_##name(const std::string& field, const std::string& cond = "", \
+    const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>()) const \
+{ \
+    return sqlite::orm::dao<typename sqlite::orm::late<cls, V>::type>::template min<V>(field, \
+        sqlite::orm::owned_where(name##_key(), cond), sqlite::orm::owned_args(args, id__)); \
+} \
+template<typename V> \
+V max_##name(const std::string& field, const std::string& cond = "", \
+    const std::map<std::string, boost::any>& args = std::map<std::string, boost::any>()) const \
+{ \
+    return sqlite::orm::dao<typename sqlite::orm::late<cls, V>::type>::template max<V>(field, \
+        sqlite::orm::owned_where(name##_key(), cond), sqlite::orm::owned_args(args, id__)); \
+} \
 void add_to_##name(const cls& i); \
 void clear_##name(); \
 void remove_from_##name(const cls& i); \
@@ -1010,15 +3834,17 @@ void set_##name(const std::vector<cls>& v);
     
 /*
  *  BELONGS TO
- *  Just makes a simple field which acts as foreign key
+ *  Just makes a simple (indexed) field which acts as foreign key.
+ *  The owner object is remembered once it was fetched (not by copies).
  */
 #define BELONGS_TO(cls, name) \
 friend class cls; \
 struct belongs_to_##cls \
-STD_FIELD_BODY(cls##_id, "INTEGER")\
+STD_FIELD_BODY_EX(cls##_id, "INTEGER", sqlite3_int64, true)\
+mutable sqlite::orm::owner_memo<cls> owner;\
 belongs_to_##cls(cls& v); \
 belongs_to_##cls()\
-: sqlite::orm::base_field((sqlite3_int64)-1)\
+: value(-1)\
 {\
 init(); \
 }\
@@ -1026,7 +3852,9 @@ init(); \
 private:\
 belongs_to_##cls cls##_id;\
 public:\
+static sqlite::orm::column<belongs_to_##cls> col_##cls##_id() { return sqlite::orm::column<belongs_to_##cls>(); } \
 static std::vector<boost::shared_ptr<MODEL_NAME> > query_by_##cls(cls& v); \
+static void resolve_##name(std::vector<boost::shared_ptr<MODEL_NAME> >& children); \
 boost::shared_ptr<cls> get_##name() const;
 
 /*
@@ -1034,7 +3862,7 @@ boost::shared_ptr<cls> get_##name() const;
  */
 #define BELONGS_TO_IMPL(model, cls, name) \
 model::belongs_to_##cls::belongs_to_##cls(cls& v)\
-: sqlite::orm::base_field((sqlite3_int64)(v.id__))\
+: value(v.id__)\
 {\
 init(); \
 }\
@@ -1044,7 +3872,32 @@ return sqlite::orm::dao<model>::query_all_by__fieldname__(STR(cls##_id), v.id__)
 }\
 boost::shared_ptr<cls> model::get_##name() const \
 {\
-return sqlite::orm::dao<cls>::query_by__fieldname__("id__", boost::any_cast<sqlite3_int64>(values_.at(STR(cls##_id))));\
+if(!cls##_id.owner.ptr || cls##_id.owner.ptr->get_id() != cls##_id.value)\
+{\
+cls##_id.owner.ptr = sqlite::orm::dao<cls>::query_by__fieldname__("id__", cls##_id.value);\
+}\
+return cls##_id.owner.ptr;\
+}\
+void model::resolve_##name(std::vector<boost::shared_ptr<model> >& children) \
+{\
+std::map<sqlite3_int64, boost::shared_ptr<cls> > owners;\
+std::vector<sqlite3_int64> ids;\
+for(std::vector<boost::shared_ptr<model> >::iterator it = children.begin(); it != children.end(); ++it)\
+{\
+if(owners.insert(std::make_pair((*it)->cls##_id.value, boost::shared_ptr<cls>())).second)\
+{\
+ids.push_back((*it)->cls##_id.value);\
+}\
+}\
+std::vector<boost::shared_ptr<cls> > tmp = sqlite::orm::dao<cls>::query_all_in__fieldname__("id__", ids);\
+for(std::vector<boost::shared_ptr<cls> >::iterator it = tmp.begin(); it != tmp.end(); ++it)\
+{\
+owners[(*it)->get_id()] = *it;\
+}\
+for(std::vector<boost::shared_ptr<model> >::iterator it = children.begin(); it != children.end(); ++it)\
+{\
+(*it)->cls##_id.owner.ptr = owners[(*it)->cls##_id.value];\
+}\
 }\
     
 /*
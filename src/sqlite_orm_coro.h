@@ -0,0 +1,306 @@
+//
+//  sqlite_orm_coro.h
+//  sqlite_orm
+//
+//  C++20 coroutine interface over dao<T>. Include after the models.
+//
+
+#pragma once
+#ifndef _SQLITE_ORM_CORO_H_
+#define _SQLITE_ORM_CORO_H_
+
+#include "sqlite_orm.h"
+
+// Without C++20 coroutines there is nothing here; the rest of the ORM
+// still builds as C++98.
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+
+namespace sqlite {
+namespace orm {
+namespace coro {
+    
+    /*
+     *  EXECUTOR
+     *  Decides where the blocking part of a dao call runs and where the
+     *  awaiting coroutine continues. Work with the same key must run in
+     *  order on the same connection (a cursor depends on it).
+     */
+    class executor
+    {
+    public:
+        virtual ~executor()
+        {
+        }
+        
+        virtual void run(const void* key, std::function<void ()> work) = 0;
+        
+        // Default: continue on the thread which did the work. An event loop
+        // would queue the handle and resume it from the loop instead.
+        virtual void resume(std::coroutine_handle<> h)
+        {
+            h.resume();
+        }
+    };
+    
+    // Runs the work on a worker_pool
+    class worker_executor
+    : public executor
+    {
+    public:
+        explicit worker_executor(worker_pool& workers)
+        : workers_(workers)
+        {
+        }
+        
+        void run(const void* key, std::function<void ()> work)
+        {
+            workers_.post(key, work);
+        }
+        
+    private:
+        worker_pool& workers_;
+    };
+    
+    /*
+     *  One blocking call made awaitable. The result (or exception) is
+     *  handed back to the coroutine by await_resume.
+     */
+    template<typename R>
+    class operation
+    {
+    public:
+        operation(executor& ex, const void* key, std::function<R ()> work)
+        : ex_(ex)
+        , key_(key)
+        , work_(std::move(work))
+        {
+        }
+        
+        bool await_ready() const
+        {
+            return false;
+        }
+        
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            ex_.run(key_, [this, h]
+            {
+                try
+                {
+                    result_.emplace(work_());
+                }
+                catch(...)
+                {
+                    error_ = std::current_exception();
+                }
+                ex_.resume(h);
+            });
+        }
+        
+        R await_resume()
+        {
+            if(error_)
+            {
+                std::rethrow_exception(error_);
+            }
+            return std::move(*result_);
+        }
+        
+    private:
+        executor& ex_;
+        const void* key_;
+        std::function<R ()> work_;
+        std::optional<R> result_;
+        std::exception_ptr error_;
+    };
+    
+    template<>
+    class operation<void>
+    {
+    public:
+        operation(executor& ex, const void* key, std::function<void ()> work)
+        : ex_(ex)
+        , key_(key)
+        , work_(std::move(work))
+        {
+        }
+        
+        bool await_ready() const
+        {
+            return false;
+        }
+        
+        void await_suspend(std::coroutine_handle<> h)
+        {
+            ex_.run(key_, [this, h]
+            {
+                try
+                {
+                    work_();
+                }
+                catch(...)
+                {
+                    error_ = std::current_exception();
+                }
+                ex_.resume(h);
+            });
+        }
+        
+        void await_resume()
+        {
+            if(error_)
+            {
+                std::rethrow_exception(error_);
+            }
+        }
+        
+    private:
+        executor& ex_;
+        const void* key_;
+        std::function<void ()> work_;
+        std::exception_ptr error_;
+    };
+    
+    /*
+     *  co_await-able dao calls. Saves and removes of the same object are
+     *  ordered like dao<T>::save_async.
+     */
+    template<typename T>
+    operation<boost::shared_ptr<T> > query_first(executor& ex, std::string where,
+        std::map<std::string, boost::any> args = std::map<std::string, boost::any>())
+    {
+        return operation<boost::shared_ptr<T> >(ex, NULL, [where, args]
+        {
+            return dao<T>::query_first(where, args);
+        });
+    }
+    
+    template<typename T>
+    operation<std::vector<boost::shared_ptr<T> > > query_all(executor& ex, std::string where,
+        std::map<std::string, boost::any> args = std::map<std::string, boost::any>())
+    {
+        return operation<std::vector<boost::shared_ptr<T> > >(ex, NULL, [where, args]
+        {
+            return dao<T>::query_all(where, args);
+        });
+    }
+    
+    template<typename T, typename E>
+    operation<std::vector<boost::shared_ptr<T> > > query_all(executor& ex, const expr<E>& cond)
+    {
+        E e = cond.self();
+        return operation<std::vector<boost::shared_ptr<T> > >(ex, NULL, [e]
+        {
+            return dao<T>::query_all(e);
+        });
+    }
+    
+    template<typename T>
+    operation<void> save(executor& ex, boost::shared_ptr<T> obj)
+    {
+        return operation<void>(ex, obj.get(), [obj]
+        {
+            dao<T>::save(*obj);
+        });
+    }
+    
+    template<typename T>
+    operation<void> remove(executor& ex, boost::shared_ptr<T> obj)
+    {
+        return operation<void>(ex, obj.get(), [obj]
+        {
+            dao<T>::remove(*obj);
+        });
+    }
+    
+    /*
+     *  ASYNC CURSOR
+     *  Streams a query in chunks: co_await next() yields up to 'chunk'
+     *  hydrated objects and an empty vector at the end. The underlying
+     *  dao cursor lives on one connection, so all its work shares a key.
+     */
+    template<typename T>
+    class async_cursor
+    {
+    public:
+        async_cursor(executor& ex, std::string where, std::map<std::string, boost::any> args, std::size_t chunk)
+        : ex_(ex)
+        , state_(std::make_shared<state>())
+        , chunk_(chunk ? chunk : 1)
+        {
+            state_->where = std::move(where);
+            state_->args = std::move(args);
+        }
+        
+        async_cursor(const async_cursor&) = delete;
+        async_cursor& operator=(const async_cursor&) = delete;
+        
+        // The statement must be released by the thread that used it
+        ~async_cursor()
+        {
+            std::shared_ptr<state> s = state_;
+            ex_.run(s.get(), [s]
+            {
+                s->rows.reset();
+            });
+        }
+        
+        operation<std::vector<boost::shared_ptr<T> > > next()
+        {
+            std::shared_ptr<state> s = state_;
+            const std::size_t n = chunk_;
+            return operation<std::vector<boost::shared_ptr<T> > >(ex_, s.get(), [s, n]
+            {
+                std::vector<boost::shared_ptr<T> > out;
+                if(s->done)
+                {
+                    return out;
+                }
+                
+                if(!s->rows)
+                {
+                    s->rows.reset(new cursor<T>(dao<T>::cursor_all(s->where, s->args)));
+                }
+                
+                out.reserve(n);
+                while(out.size() < n && s->rows->next())
+                {
+                    out.push_back(s->rows->get());
+                }
+                
+                if(out.size() < n)
+                {
+                    s->done = true;
+                    s->rows.reset();
+                }
+                return out;
+            });
+        }
+        
+    private:
+        struct state
+        {
+            std::string where;
+            std::map<std::string, boost::any> args;
+            std::unique_ptr<cursor<T> > rows;
+            bool done = false;
+        };
+        
+        executor& ex_;
+        std::shared_ptr<state> state_;
+        std::size_t chunk_;
+    };
+    
+}; // coro
+}; // orm
+}; // sqlite
+
+#endif
+
+#endif // _SQLITE_ORM_CORO_H_